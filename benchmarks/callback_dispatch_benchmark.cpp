@@ -0,0 +1,76 @@
+// libstdaudio
+// Copyright (c) 2019 - Conrad Jones
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <audio>
+
+// This benchmark compares std::function (the previous storage of the ALSA
+// backend) with the inline callback storage used now: the cost of
+// dispatching one period to the user callback, and the cost of storing a
+// callback whose captures exceed std::function's small buffer.
+
+using namespace std::experimental;
+
+constexpr size_t num_frames = 256;
+constexpr size_t num_channels = 2;
+constexpr size_t num_periods = 2'000'000;
+
+using io_t = audio_device_io<int16_t>;
+
+template <typename _CallbackType>
+double ns_per_period(_CallbackType& callback, io_t& io) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < num_periods; ++i)
+    callback(io);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / num_periods;
+}
+
+template <typename _StorageType, typename _CallbackType>
+double ns_per_store(const _CallbackType& callback) {
+  constexpr size_t num_stores = 1'000'000;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < num_stores; ++i) {
+    _StorageType storage = callback;
+    asm volatile("" : : "r"(&storage) : "memory");
+  }
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / num_stores;
+}
+
+int main() {
+  std::array<int16_t, num_frames * num_channels> data = {};
+  io_t io;
+  io.output_buffer = audio_buffer<int16_t>(data.data(), num_frames, num_channels, contiguous_interleaved);
+
+  int16_t value = 0;
+  auto user_callback = [&value](io_t& io) noexcept {
+    io.output_buffer->operator()(0, 0) = ++value;
+  };
+
+  std::function<void(io_t&)> function_callback = user_callback;
+  __alsa_inline_callback<void(io_t&)> inline_callback = user_callback;
+
+  // warm up both paths before measuring
+  ns_per_period(function_callback, io);
+  ns_per_period(inline_callback, io);
+
+  std::cout << "std::function:          " << ns_per_period(function_callback, io) << " ns/period\n";
+  std::cout << "__alsa_inline_callback: " << ns_per_period(inline_callback, io) << " ns/period\n";
+  std::cout << "direct call:            " << ns_per_period(user_callback, io) << " ns/period\n";
+
+  // e.g. an oscillator bank: too large for std::function's inline buffer
+  std::array<float, 16> phases = {};
+  auto large_callback = [phases, &value](io_t& io) noexcept {
+    io.output_buffer->operator()(0, 0) = static_cast<int16_t>(phases[0]) + ++value;
+  };
+
+  std::cout << "store std::function:          " << ns_per_store<std::function<void(io_t&)>>(large_callback) << " ns\n";
+  std::cout << "store __alsa_inline_callback: " << ns_per_store<__alsa_inline_callback<void(io_t&)>>(large_callback) << " ns\n";
+  std::cout << "(last sample " << data[0] << ")" << std::endl;
+}
@@ -0,0 +1,94 @@
+// libstdaudio
+// Copyright (c) 2019 - Conrad Jones
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
+
+#include <chrono>
+#include <iterator>
+#include <iostream>
+#include <audio>
+
+// This benchmark measures how long building the device lists takes, and
+// how long the getters take afterwards. Each device opens its PCM once while
+// it is enumerated; the getters then read the probed capabilities and must
+// not touch the hardware again. Descriptor lists, which open nothing, are
+// timed for comparison, as is looking up the default devices, which every
+// program that just plays to the default device pays at startup. Pass a
+// file name to run with the capability cache; the first run fills it.
+
+using namespace std::experimental;
+
+constexpr size_t num_enumerations = 20;
+constexpr size_t num_queries = 100'000;
+
+template <typename _FunctionType>
+double us_per_call(size_t count, _FunctionType&& function) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i)
+    function();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::micro>(end - start).count() / count;
+}
+
+size_t query_all(audio_device_list& devices) {
+  size_t total = 0;
+  for (auto& device : devices) {
+    total += device.get_sample_rate();
+    total += device.get_buffer_size_frames();
+    total += device.get_supported_sample_rates().size();
+    total += device.get_supported_audio_formats().size();
+  }
+  return total;
+}
+
+void run(const char* name, audio_device_list (*get_list)()) {
+  double enumerate_us = us_per_call(num_enumerations, [&] {
+    auto devices = get_list();
+    asm volatile("" : : "r"(&devices) : "memory");
+  });
+
+  auto devices = get_list();
+  size_t num_devices = std::distance(devices.begin(), devices.end());
+  size_t total = 0;
+  double query_us = us_per_call(num_queries, [&] {
+    total += query_all(devices);
+  });
+
+  std::cout << name << ": " << num_devices << " devices, "
+            << enumerate_us / 1000.0 << " ms per enumeration, "
+            << query_us * 1000.0 << " ns per query of all getters"
+            << " (checksum " << total << ")\n";
+}
+
+template <typename _ListFunctionType>
+void run_descriptors(const char* name, _ListFunctionType get_list) {
+  double enumerate_us = us_per_call(num_enumerations, [&] {
+    auto descriptors = get_list();
+    asm volatile("" : : "r"(&descriptors) : "memory");
+  });
+
+  std::cout << name << " descriptors: " << enumerate_us / 1000.0 << " ms per enumeration\n";
+}
+
+template <typename _DefaultFunctionType>
+void run_default(const char* name, _DefaultFunctionType get_default) {
+  bool found = false;
+  double lookup_us = us_per_call(num_enumerations, [&] {
+    found = get_default().has_value();
+  });
+
+  std::cout << name << " default: " << lookup_us / 1000.0 << " ms per lookup"
+            << (found ? "" : " (none)") << "\n";
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1)
+    set_audio_device_capability_cache_file(argv[1]);
+
+  run("input ", get_audio_input_device_list);
+  run("output", get_audio_output_device_list);
+  run_descriptors("input ", get_audio_input_device_descriptors);
+  run_descriptors("output", get_audio_output_device_descriptors);
+  run_default("input ", get_default_audio_input_device);
+  run_default("output", get_default_audio_output_device);
+}
@@ -0,0 +1,89 @@
+// libstdaudio
+// Copyright (c) 2019 - Conrad Jones
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <audio>
+
+// This benchmark plays silence on the default output device with a deep
+// buffer and timer scheduling, and rewinds the output a number of times as
+// far back as the hardware allows. It prints how long the
+// callback took to be called again from the rewound position, and how far
+// ahead of the hardware the rewound audio still was: roughly the rewind
+// margin, against the full buffer without rewinding.
+
+using namespace std::experimental;
+
+constexpr int num_rewinds = 20;
+constexpr auto buffer_time = std::chrono::milliseconds(500);
+
+int main() {
+  auto device = get_default_audio_output_device();
+  if (!device) {
+    std::cout << "no default output device\n";
+    return 0;
+  }
+
+  std::atomic<uint64_t> rendered_position = 0;
+  std::atomic<std::int64_t> rewound_lead_us = 0;
+  std::atomic<bool> rewound = false;
+
+  device->set_target_latency(buffer_time, 4);
+  device->set_scheduling(audio_device_scheduling::timer);
+  device->connect([&](audio_device& output, audio_device_io<float>& io) noexcept {
+    if (!io.output_buffer.has_value())
+      return;
+
+    auto& out = *io.output_buffer;
+    for (size_t frame = 0; frame < out.size_frames(); ++frame)
+      for (size_t channel = 0; channel < out.size_channels(); ++channel)
+        out(frame, channel) = 0;
+
+    const uint64_t position = output.get_output_frame_position();
+    if (position < rendered_position.load() && !rewound.load()) {
+      rewound_lead_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        *io.output_time - std::chrono::steady_clock::now()).count();
+      rewound = true;
+    }
+    rendered_position = position + out.size_frames();
+  });
+
+  if (!device->start()) {
+    std::cout << "cannot start the device\n";
+    return 1;
+  }
+  std::this_thread::sleep_for(buffer_time * 2);
+
+  double total_us = 0;
+  std::int64_t total_lead_us = 0;
+  int completed = 0;
+  for (int i = 0; i < num_rewinds; ++i) {
+    rewound = false;
+    const auto start = std::chrono::steady_clock::now();
+    if (!device->rewind_output(0))
+      break;
+
+    while (!rewound.load() && std::chrono::steady_clock::now() - start < buffer_time)
+      std::this_thread::yield();
+
+    if (rewound.load()) {
+      total_us += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+      total_lead_us += rewound_lead_us.load();
+      ++completed;
+    }
+    std::this_thread::sleep_for(buffer_time / 4);
+  }
+  device->stop();
+
+  const audio_device_stats stats = device->get_stats();
+  std::cout << "buffer: " << device->get_buffer_size_frames() << " frames, rewinds: " << stats.rewinds
+            << ", frames rewound: " << stats.frames_rewound << "\n";
+  if (completed > 0)
+    std::cout << "request to callback: " << total_us / completed << " us, rewound audio played after "
+              << total_lead_us / completed << " us\n";
+}
@@ -0,0 +1,74 @@
+// libstdaudio
+// Copyright (c) 2019 - Conrad Jones
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <vector>
+#include <audio>
+
+// This benchmark measures the throughput of the sample conversion the ALSA
+// backend runs when a callback's sample type is not the format the device
+// was opened in, for every supported pair of types. Each pair is compared
+// with the scalar reference conversion, which also checks that both agree.
+
+using namespace std::experimental;
+
+constexpr size_t num_samples = 512 * 2;  // one stereo period of 512 frames
+constexpr size_t num_periods = 200'000;
+
+template <typename _SampleType>
+std::vector<_SampleType> make_input() {
+  std::mt19937 engine(42);
+  std::uniform_real_distribution<float> distribution(-1.1f, 1.1f);
+
+  std::vector<float> samples(num_samples);
+  for (auto& sample : samples)
+    sample = distribution(engine);
+
+  std::vector<_SampleType> input(num_samples);
+  for (size_t i = 0; i < num_samples; ++i)
+    input[i] = __alsa_sample_converter::convert_sample<float, _SampleType>(samples[i]);
+  return input;
+}
+
+template <typename _ConvertType>
+double msamples_per_second(_ConvertType&& convert) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < num_periods; ++i)
+    convert();
+  auto end = std::chrono::steady_clock::now();
+  return num_samples * num_periods / std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+template <typename _From, typename _To>
+void run(const char* name) {
+  const std::vector<_From> input = make_input<_From>();
+  std::vector<_To> vectorised(num_samples);
+  std::vector<_To> reference(num_samples);
+
+  double vectorised_rate = msamples_per_second([&] {
+    __alsa_sample_converter::convert(input.data(), vectorised.data(), num_samples);
+    asm volatile("" : : "r"(vectorised.data()) : "memory");
+  });
+
+  double reference_rate = msamples_per_second([&] {
+    for (size_t i = 0; i < num_samples; ++i)
+      reference[i] = __alsa_sample_converter::convert_sample<_From, _To>(input[i]);
+    asm volatile("" : : "r"(reference.data()) : "memory");
+  });
+
+  std::cout << name << ": " << vectorised_rate << " Msamples/s, scalar " << reference_rate << " Msamples/s"
+            << (vectorised == reference ? "" : " (MISMATCH)") << "\n";
+}
+
+int main() {
+  run<float, int16_t>("float   -> int16_t");
+  run<float, int32_t>("float   -> int32_t");
+  run<int16_t, float>("int16_t -> float  ");
+  run<int32_t, float>("int32_t -> float  ");
+  run<int16_t, int32_t>("int16_t -> int32_t");
+  run<int32_t, int16_t>("int32_t -> int16_t");
+}
@@ -0,0 +1,75 @@
+// libstdaudio
+// Copyright (c) 2019 - Conrad Jones
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <audio>
+
+// This benchmark plays silence on the default output device and prints how
+// many system calls the processing thread made per period, as counted in
+// audio_device_stats, once with period interrupts and once with the timer
+// scheduler. A steady-state period should cost one poll() with interrupts,
+// and a ppoll() and a hwsync with the timer, which wakes up less than once
+// per period. Startup is excluded by resetting the stats once the device
+// runs. Exits with 1 when a mode goes over its budget.
+
+using namespace std::experimental;
+
+constexpr auto warm_up_time = std::chrono::milliseconds(500);
+constexpr auto run_time = std::chrono::seconds(3);
+
+bool run(audio_device_scheduling scheduling, const char* name, double budget) {
+  auto device = get_default_audio_output_device();
+  if (!device) {
+    std::cout << "no default output device\n";
+    return true;
+  }
+
+  device->set_target_latency(std::chrono::milliseconds(20), 4);
+  device->set_scheduling(scheduling);
+  device->connect([](audio_device&, audio_device_io<float>& io) noexcept {
+    if (!io.output_buffer.has_value())
+      return;
+
+    auto& out = *io.output_buffer;
+    for (size_t frame = 0; frame < out.size_frames(); ++frame)
+      for (size_t channel = 0; channel < out.size_channels(); ++channel)
+        out(frame, channel) = 0;
+  });
+
+  if (!device->start()) {
+    std::cout << name << ": cannot start the device\n";
+    return true;
+  }
+
+  std::this_thread::sleep_for(warm_up_time);
+  device->reset_stats();
+  std::this_thread::sleep_for(run_time);
+
+  const audio_device_stats stats = device->get_stats();
+  const auto period_size = device->get_period_size_frames();
+  device->stop();
+
+  if (period_size == 0 || stats.frames_processed < period_size) {
+    std::cout << name << ": no periods processed\n";
+    return false;
+  }
+
+  const double periods = static_cast<double>(stats.frames_processed) / period_size;
+  const double per_period = stats.system_calls / periods;
+  const bool within_budget = per_period <= budget && stats.xruns == 0;
+  std::cout << name << ": " << per_period << " system calls/period, "
+            << stats.wakeups / periods << " wakeups/period, "
+            << stats.xruns << " xruns"
+            << (within_budget ? "" : " (OVER BUDGET)") << "\n";
+  return within_budget;
+}
+
+int main() {
+  bool within_budget = run(audio_device_scheduling::interrupt, "interrupt", 1.1);
+  within_budget = run(audio_device_scheduling::timer, "timer    ", 2.1) && within_budget;
+  return within_budget ? 0 : 1;
+}
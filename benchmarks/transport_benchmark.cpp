@@ -0,0 +1,67 @@
+// libstdaudio
+// Copyright (c) 2019 - Conrad Jones
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <audio>
+
+// This benchmark plays silence on the default output device and measures
+// how long the transport calls take: the first start(), which opens and
+// configures the PCM, a stop() and start() with unchanged settings, which
+// reuses the configured PCM, and a pause() and resume(). Each call is timed
+// on its own, averaged over a number of cycles with playback in between.
+
+using namespace std::experimental;
+
+constexpr int num_cycles = 50;
+constexpr auto play_time = std::chrono::milliseconds(20);
+
+double us_per_call(const std::function<bool()>& call) {
+  auto start = std::chrono::steady_clock::now();
+  bool result = call();
+  auto end = std::chrono::steady_clock::now();
+  if (!result)
+    std::cout << "call failed\n";
+  return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+int main() {
+  auto device = get_default_audio_output_device();
+  if (!device) {
+    std::cout << "no default output device\n";
+    return 0;
+  }
+
+  device->connect([](audio_device&, audio_device_io<float>& io) noexcept {
+    if (!io.output_buffer.has_value())
+      return;
+
+    auto& out = *io.output_buffer;
+    for (size_t frame = 0; frame < out.size_frames(); ++frame)
+      for (size_t channel = 0; channel < out.size_channels(); ++channel)
+        out(frame, channel) = 0;
+  });
+
+  std::cout << "first start: " << us_per_call([&] { return device->start(); }) << " us\n";
+
+  double stop_us = 0, start_us = 0, pause_us = 0, resume_us = 0;
+  for (int cycle = 0; cycle < num_cycles; ++cycle) {
+    std::this_thread::sleep_for(play_time);
+    stop_us += us_per_call([&] { return device->stop(); });
+    start_us += us_per_call([&] { return device->start(); });
+
+    std::this_thread::sleep_for(play_time);
+    pause_us += us_per_call([&] { return device->pause(); });
+    resume_us += us_per_call([&] { return device->resume(); });
+  }
+  device->stop();
+
+  std::cout << "stop:    " << stop_us / num_cycles << " us\n"
+            << "restart: " << start_us / num_cycles << " us\n"
+            << "pause:   " << pause_us / num_cycles << " us\n"
+            << "resume:  " << resume_us / num_cycles << " us\n";
+}
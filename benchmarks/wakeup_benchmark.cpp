@@ -0,0 +1,72 @@
+// libstdaudio
+// Copyright (c) 2019 - Conrad Jones
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <audio>
+
+// This benchmark plays silence on the default output device, woken by the
+// period interrupts, by the timer scheduler and by spinning, and prints how
+// often the processing thread woke up, how often it ran the callback, how
+// many xruns it saw and how late it woke after the driver's pointer update.
+// With a large buffer the timer scheduler should wake up far less often than
+// once per period; spinning should cut the wakeup delay and its jitter, at
+// the cost of a busy core. Run it pinned to an isolated core to compare.
+
+using namespace std::experimental;
+
+constexpr auto run_time = std::chrono::seconds(5);
+
+void run(audio_device_scheduling scheduling, const char* name) {
+  auto device = get_default_audio_output_device();
+  if (!device) {
+    std::cout << "no default output device\n";
+    return;
+  }
+
+  device->set_target_latency(std::chrono::milliseconds(100), 4);
+  device->set_scheduling(scheduling);
+  if (scheduling == audio_device_scheduling::spin) {
+    const auto period = std::chrono::microseconds(
+      std::uint64_t(device->get_period_size_frames()) * 1'000'000 / device->get_sample_rate());
+    device->set_spin_budget(period);
+  }
+  device->connect([](audio_device&, audio_device_io<float>& io) noexcept {
+    if (!io.output_buffer.has_value())
+      return;
+
+    auto& out = *io.output_buffer;
+    for (size_t frame = 0; frame < out.size_frames(); ++frame)
+      for (size_t channel = 0; channel < out.size_channels(); ++channel)
+        out(frame, channel) = 0;
+  });
+
+  if (!device->start()) {
+    std::cout << name << ": cannot start the device\n";
+    return;
+  }
+
+  std::this_thread::sleep_for(run_time);
+  device->stop();
+
+  const audio_device_stats stats = device->get_stats();
+  const double seconds = std::chrono::duration<double>(run_time).count();
+  auto us = [](std::chrono::nanoseconds ns) { return std::chrono::duration<double, std::micro>(ns).count(); };
+  std::cout << name << ": " << stats.wakeups / seconds << " wakeups/s, "
+            << stats.callbacks / seconds << " callbacks/s, "
+            << stats.xruns << " xruns";
+  if (scheduling != audio_device_scheduling::timer)
+    std::cout << ", wakeup delay " << us(stats.average_wakeup_delay) << " us (max "
+              << us(stats.max_wakeup_delay) << " us, jitter " << us(stats.wakeup_jitter) << " us)";
+  std::cout << "\n";
+}
+
+int main() {
+  run(audio_device_scheduling::interrupt, "interrupt");
+  run(audio_device_scheduling::timer, "timer    ");
+  run(audio_device_scheduling::spin, "spin     ");
+}
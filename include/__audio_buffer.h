@@ -7,9 +7,13 @@
 
 #include <cassert>
 #include <chrono>
+#include <utility>
 
 _LIBSTDAUDIO_NAMESPACE_BEGIN
 
+// The channel pointers live inside the buffer, so buffers never allocate.
+inline constexpr size_t __audio_buffer_max_num_channels = 64;
+
 struct contiguous_interleaved_t{};
 inline constexpr contiguous_interleaved_t contiguous_interleaved;
 
@@ -97,11 +101,12 @@ private:
   index_type _num_frames = 0;
   index_type _num_channels = 0;
   index_type _stride = 0;
-  constexpr static size_t _max_num_channels = 16;
+  constexpr static size_t _max_num_channels = __audio_buffer_max_num_channels;
   std::array<sample_type*, _max_num_channels> _channels = {};
 };
 
-// TODO: this is currently macOS specific!
+// CoreAudio host time is read as steady_clock ticks on macOS. On Linux this
+// is CLOCK_MONOTONIC, the clock the ALSA backend has the driver timestamp in.
 using audio_clock_t = chrono::steady_clock;
 
 template <typename _SampleType>
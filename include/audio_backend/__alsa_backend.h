@@ -5,18 +5,47 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cctype>
+#include <cmath>
+#include <charconv>
+#include <cstring>
 #include <string>
 #include <iostream>
 #include <vector>
 #include <functional>
+#include <future>
+#include <iterator>
 #include <memory>
 #include <forward_list>
+#include <list>
 #include <map>
+#include <limits>
 #include <atomic>
+#include <chrono>
 #include <thread>
+#include <tuple>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <variant>
+#include <alloca.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <alsa/asoundlib.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 _LIBSTDAUDIO_NAMESPACE_BEGIN
 
 // -----------------------------------------------------------------------------
@@ -84,6 +113,15 @@ struct __snd_device_name_hint_free {
 
 using __snd_device_name_hint_raai = unique_ptr<void*, __snd_device_name_hint_free>;
 
+struct __snd_hint_string_free {
+  void operator()(char* ptr)
+  {
+    free(ptr);
+  }
+};
+
+using __snd_hint_string_raai = unique_ptr<char, __snd_hint_string_free>;
+
 struct __snd_pcm_format_mask_free {
   void operator()(snd_pcm_format_mask_t* formatMask)
   {
@@ -102,20 +140,6 @@ struct __snd_pcm_chmap_free {
 
 using __snd_pcm_chmap_raai = unique_ptr<snd_pcm_chmap_t, __snd_pcm_chmap_free>;
 
-__snd_pcm_chmap_raai __make_snd_pcm_chmap(size_t count)
-{
-  snd_pcm_chmap_t * chmap = static_cast<snd_pcm_chmap_t*>(malloc(sizeof(int) + sizeof(int) * count));
-  chmap->channels = count;
-  //TODO support other channel maps
-  if (count == 2) {
-    chmap->pos[0] = SND_CHMAP_FL;
-    chmap->pos[1] = SND_CHMAP_FR;
-  } else if (count == 1) {
-    chmap->pos[0] = SND_CHMAP_FC;
-  }
-  return __snd_pcm_chmap_raai(chmap);
-}
-
 struct __snd_pcm_sw_params_free {
   void operator()(snd_pcm_sw_params_t* ptr)
   {
@@ -125,7 +149,7 @@ struct __snd_pcm_sw_params_free {
 
 using __snd_pcm_sw_params_raai = unique_ptr<snd_pcm_sw_params_t, __snd_pcm_sw_params_free>;
 
-__snd_pcm_sw_params_raai __make_snd_pcm_sw_params() {
+inline __snd_pcm_sw_params_raai __make_snd_pcm_sw_params() {
   snd_pcm_sw_params_t *params = nullptr;
   snd_pcm_sw_params_malloc(&params);
   return __snd_pcm_sw_params_raai(params);
@@ -140,6 +164,104 @@ constexpr auto __array_of(T&&... t)
   return { { std::forward<T>(t)... } };
 }
 
+// Size of the storage audio_device reserves for the user callback. Callbacks
+// with larger captures fail to compile rather than being heap allocated.
+#ifndef _LIBSTDAUDIO_ALSA_CALLBACK_CAPACITY
+#define _LIBSTDAUDIO_ALSA_CALLBACK_CAPACITY 128
+#endif
+
+template <typename _Signature, size_t _Capacity = _LIBSTDAUDIO_ALSA_CALLBACK_CAPACITY>
+class __alsa_inline_callback;
+
+// Type-erased callable stored in place. Unlike std::function it never
+// allocates, and the call goes through a single function pointer whose
+// target has the user callback inlined into it.
+template <typename _Ret, typename... _Args, size_t _Capacity>
+class __alsa_inline_callback<_Ret(_Args...), _Capacity> {
+public:
+  // Whether a callable of this type can be stored, checked when it is.
+  template <typename _CallbackType>
+  inline static constexpr bool fits = sizeof(decay_t<_CallbackType>) <= _Capacity;
+
+  template <typename _CallbackType>
+  inline static constexpr bool is_aligned = alignof(decay_t<_CallbackType>) <= alignof(max_align_t);
+
+  __alsa_inline_callback() noexcept = default;
+
+  template <typename _CallbackType,
+            typename = enable_if_t<!is_same_v<decay_t<_CallbackType>, __alsa_inline_callback>>>
+  __alsa_inline_callback(_CallbackType&& callback) noexcept {
+    using callback_t = decay_t<_CallbackType>;
+    static_assert(fits<callback_t>, "callback does not fit into the inline storage, raise _LIBSTDAUDIO_ALSA_CALLBACK_CAPACITY");
+    static_assert(is_aligned<callback_t>, "callback is over-aligned");
+    static_assert(is_nothrow_move_constructible_v<callback_t>, "callback must be nothrow move constructible");
+
+    ::new (static_cast<void*>(&_storage)) callback_t(forward<_CallbackType>(callback));
+    _invoke = [](void* storage, _Args... args) noexcept -> _Ret {
+      return (*static_cast<callback_t*>(storage))(forward<_Args>(args)...);
+    };
+    _manage = [](void* destination, void* source) noexcept {
+      if (destination)
+        ::new (destination) callback_t(move(*static_cast<callback_t*>(source)));
+      static_cast<callback_t*>(source)->~callback_t();
+    };
+  }
+
+  __alsa_inline_callback(__alsa_inline_callback&& other) noexcept {
+    _take(other);
+  }
+
+  __alsa_inline_callback& operator=(__alsa_inline_callback&& other) noexcept {
+    if (this != &other) {
+      _reset();
+      _take(other);
+    }
+    return *this;
+  }
+
+  __alsa_inline_callback(const __alsa_inline_callback&) = delete;
+  __alsa_inline_callback& operator=(const __alsa_inline_callback&) = delete;
+
+  ~__alsa_inline_callback() {
+    _reset();
+  }
+
+  explicit operator bool() const noexcept {
+    return _invoke != nullptr;
+  }
+
+  _Ret operator()(_Args... args) noexcept {
+    assert(_invoke != nullptr);
+    return _invoke(&_storage, forward<_Args>(args)...);
+  }
+
+private:
+  void _take(__alsa_inline_callback& other) noexcept {
+    if (!other._invoke)
+      return;
+
+    other._manage(&_storage, &other._storage);
+    _invoke = exchange(other._invoke, nullptr);
+    _manage = exchange(other._manage, nullptr);
+  }
+
+  void _reset() noexcept {
+    if (!_invoke)
+      return;
+
+    _manage(nullptr, &_storage);
+    _invoke = nullptr;
+    _manage = nullptr;
+  }
+
+  using __invoke_t = _Ret (*)(void*, _Args...) noexcept;
+  using __manage_t = void (*)(void*, void*) noexcept;
+
+  aligned_storage_t<_Capacity, alignof(max_align_t)> _storage;
+  __invoke_t _invoke = nullptr;
+  __manage_t _manage = nullptr;
+};
+
 // TODO: make __coreaudio_sample_type flexible according to the recommendation (see AudioSampleType).
 using __coreaudio_native_sample_type = int16_t;
 
@@ -150,930 +272,4738 @@ struct __alsa_stream_config {
   int output_config = {0};
 };
 
+// Configuration paths act on the result: a failed call fails the open or
+// the probe it belongs to. Debug builds also log it.
 class __alsa_util {
 public:
   static bool check_error(int error) {
-    if (error == 0)
+    if (error >= 0)
       return true;
 
-    _log_message(_format_error(error));
-    assert(false);
+#ifndef NDEBUG
+    cerr << "__alsa_backend error: " << snd_strerror(error) << '\n';
+#endif
     return false;
   }
-
-private:
-  static string _format_error(int error) {
-    return snd_strerror(error);
-  }
-
-  static void _log_message(const string& s) {
-    // TODO: only do this in DEBUG
-    cerr << "__alsa_backend error: " << s << endl;
-  }
 };
 
-class __alsa_pollfd {
+enum class audio_thread_scheduling {
+  other,
+  fifo,
+  round_robin
+};
 
-private:
-  int _poll_fd_count = {0};
-  std::vector<pollfd> _poll_fd;
-  snd_pcm_t* _pcm;
+// Scheduling requested for the processing thread when an audio_device is started.
+struct audio_thread_policy {
+  audio_thread_scheduling scheduling = audio_thread_scheduling::fifo;
+  int priority = 70;
+  // CPUs the processing thread may run on, empty leaves the affinity untouched.
+  vector<int> cpu_affinity = {};
+  // mlockall(MCL_CURRENT | MCL_FUTURE) the whole process before starting.
+  bool lock_memory = false;
+  // Bytes of stack touched by the processing thread before the first callback.
+  size_t prefault_stack_size = 0;
+};
 
-  friend std::optional<__alsa_pollfd> __make_alsa_pollfd(snd_pcm_t* pcm);
+// What start() actually managed to apply. When the process is not allowed to
+// use real-time scheduling (RLIMIT_RTPRIO is 0 and no CAP_SYS_NICE) the thread
+// falls back to audio_thread_scheduling::other and error holds the errno.
+struct audio_thread_policy_status {
+  audio_thread_scheduling scheduling = audio_thread_scheduling::other;
+  int priority = 0;
+  bool affinity_applied = false;
+  bool memory_locked = false;
+  bool stack_prefaulted = false;
+  int error = 0;
+};
 
+class __alsa_thread_util {
 public:
-  __alsa_pollfd() = default;
+  static audio_thread_policy_status apply_policy(pthread_t thread, const audio_thread_policy& policy) {
+    audio_thread_policy_status status;
+
+    if (policy.lock_memory) {
+      if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+        status.memory_locked = true;
+      else
+        _record_error(status, errno);
+    }
 
-  int wait()
-  {
-    while (true) {
-      int result = poll(_poll_fd.data(), _poll_fd.size(), -1);
-      if (result < 0) {
-        return -1;
+    if (!policy.cpu_affinity.empty()) {
+      cpu_set_t cpu_set;
+      CPU_ZERO(&cpu_set);
+      for (int cpu : policy.cpu_affinity) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+          CPU_SET(cpu, &cpu_set);
       }
-      unsigned short revents;
 
-      result = snd_pcm_poll_descriptors_revents(_pcm, _poll_fd.data(), _poll_fd.size() - 1, &revents);
-      if (result < 0) {
-        return -1;
-      }
-      if (revents & (POLLERR | POLLNVAL | POLLHUP)) {
-        return 0;
-      }
-      if (revents & POLLOUT)
-        return 0;
+      int result = pthread_setaffinity_np(thread, sizeof(cpu_set), &cpu_set);
+      if (result == 0)
+        status.affinity_applied = true;
+      else
+        _record_error(status, result);
     }
-  }
-};
-
-std::optional<__alsa_pollfd> __make_alsa_pollfd(snd_pcm_t* pcm) {
-  __alsa_pollfd pollfd;
 
-  pollfd._pcm = pcm;
-  pollfd._poll_fd_count = snd_pcm_poll_descriptors_count(pcm);
-  if (pollfd._poll_fd_count <= 0)
-    return nullopt;
+    if (policy.scheduling == audio_thread_scheduling::other)
+      return status;
 
-  pollfd._poll_fd.resize(pollfd._poll_fd_count + 1);
-  pollfd._poll_fd[0] = {};
-  pollfd._poll_fd[1] = {};
+    const int sched_policy = policy.scheduling == audio_thread_scheduling::fifo ? SCHED_FIFO : SCHED_RR;
+    int priority = clamp(policy.priority, sched_get_priority_min(sched_policy), sched_get_priority_max(sched_policy));
 
-  int result = snd_pcm_poll_descriptors(pcm, pollfd._poll_fd.data(), pollfd._poll_fd_count);
-  if (result < 0)
-    return nullopt;
+    int result = _set_scheduling(thread, sched_policy, priority);
+    if (result == EPERM) {
+      // Unprivileged processes may still be granted a lower ceiling through RLIMIT_RTPRIO.
+      rlimit rtprio_limit = {};
+      if (getrlimit(RLIMIT_RTPRIO, &rtprio_limit) == 0 && rtprio_limit.rlim_cur > 0 && rtprio_limit.rlim_cur < static_cast<rlim_t>(priority)) {
+        priority = static_cast<int>(rtprio_limit.rlim_cur);
+        result = _set_scheduling(thread, sched_policy, priority);
+      }
+    }
 
-  int poll_exit_pipe_fd[2];
-  if (pipe2(poll_exit_pipe_fd, O_NONBLOCK) != 0) {
-    return nullopt;
-  }
-  pollfd._poll_fd[pollfd._poll_fd_count].fd = poll_exit_pipe_fd[0];
-  pollfd._poll_fd[pollfd._poll_fd_count].events = POLLIN;
-  return pollfd;
-}
+    if (result != 0) {
+      _record_error(status, result);
+      return status;
+    }
 
-struct audio_device_exception : public runtime_error {
-  explicit audio_device_exception(const char* what)
-    : runtime_error(what) {
+    status.scheduling = policy.scheduling;
+    status.priority = priority;
+    return status;
   }
-};
 
-struct __alsa_audio_device_id
-{
-  int card_id {-1};
-  int device_id {-1};
+  // Starts a processing thread that applies the policy to itself and
+  // prefaults its stack before it runs body, and waits until it has, so
+  // that its first periods already run under the policy. status receives
+  // what was applied.
+  template <typename _Body>
+  static thread start_thread(const audio_thread_policy& policy, audio_thread_policy_status& status, _Body body) {
+    promise<audio_thread_policy_status> applied;
+    future<audio_thread_policy_status> applied_status = applied.get_future();
+
+    thread processing_thread([&policy, applied = move(applied), body = move(body)]() mutable {
+      audio_thread_policy_status thread_status = apply_policy(pthread_self(), policy);
+      thread_status.stack_prefaulted = prefault_stack(policy.prefault_stack_size);
+      applied.set_value(thread_status);
+      body();
+    });
 
-  string get_card_str_id() const {
-    return string("hw:") + to_string(card_id);
+    status = applied_status.get();
+    return processing_thread;
   }
 
-  __snd_ctl_card_info_raai get_card_info() const {
-    __snd_ctl_t_raai snd_ctl_handle = card_handle();
-    snd_ctl_card_info_t* card_info_raw = {nullptr};
+  // Touches each page of the requested stack depth so the first callbacks do
+  // not take page faults. Must not be inlined, the alloca is released on return.
+  // False, touching nothing, when size is 0 or more than RLIMIT_STACK or the
+  // calling thread's remaining stack allow.
+  [[gnu::noinline]] static bool prefault_stack(size_t size) {
+    if (size == 0 || size > _available_stack())
+      return false;
 
-    snd_ctl_card_info_malloc(&card_info_raw);
-    return __snd_ctl_card_info_raai(card_info_raw);
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    volatile unsigned char* stack = static_cast<volatile unsigned char*>(alloca(size));
+    for (size_t i = 0; i < size; i += page_size)
+      stack[i] = 0;
+    return true;
   }
 
-  __snd_pcm_info_t_raai get_pcm_info() const {
-    snd_pcm_info_t* pcm_info_raw = {nullptr};
-    snd_pcm_info_malloc(&pcm_info_raw);
+  // One iteration of a spin-wait: lets a sibling hyperthread run and saves
+  // power without giving up the CPU.
+  static void relax_cpu() noexcept {
+#if defined(__SSE2__)
+    _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+  }
 
-    if (pcm_info_raw) {
-      snd_pcm_info_set_device(pcm_info_raw, device_id);
-      snd_pcm_info_set_subdevice(pcm_info_raw, 0);
+  // Spins until ready() holds, or running turns false. False once the
+  // deadline passes first.
+  template <typename _ReadyFunction>
+  static bool spin_until(_ReadyFunction&& ready, const atomic<bool>& running,
+                         chrono::time_point<audio_clock_t> deadline) noexcept {
+    while (running) {
+      if (ready())
+        return true;
+
+      relax_cpu();
+      if (audio_clock_t::now() >= deadline)
+        return false;
     }
-
-    return __snd_pcm_info_t_raai(pcm_info_raw);
+    return true;
   }
 
-  string get_card_name(__snd_ctl_t_raai& snd_ctl_handle) const {
-    __snd_ctl_card_info_raai card_info = get_card_info();
-    if (!card_info)
-      return string();
+private:
+  // Stack left below the caller, less a few pages for the frames that
+  // follow. Zero when it cannot be determined.
+  static size_t _available_stack() noexcept {
+    const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t reserve = 16 * page_size;
+
+    size_t limit = numeric_limits<size_t>::max();
+    rlimit stack_limit = {};
+    if (getrlimit(RLIMIT_STACK, &stack_limit) == 0 && stack_limit.rlim_cur != RLIM_INFINITY)
+      limit = static_cast<size_t>(stack_limit.rlim_cur);
+
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+      return 0;
 
-    int result = snd_ctl_card_info(snd_ctl_handle.get(), card_info.get());
-    if (result < 0)
-      return string();
+    void* stack_address = nullptr;
+    size_t stack_size = 0;
+    const int result = pthread_attr_getstack(&attr, &stack_address, &stack_size);
+    pthread_attr_destroy(&attr);
+    if (result != 0)
+      return 0;
 
-    string card_name = snd_ctl_card_info_get_name(card_info.get());
-    return card_name;
-  }
+    // stacks grow down from stack_address + stack_size
+    const unsigned char marker = 0;
+    const auto position = reinterpret_cast<uintptr_t>(&marker);
+    const auto lowest = reinterpret_cast<uintptr_t>(stack_address);
+    if (position <= lowest + reserve)
+      return 0;
 
-  string get_device_id_str() const {
-    return get_card_str_id() + ',' + to_string(device_id);
+    return min(limit, static_cast<size_t>(position - lowest - reserve));
   }
 
-  string get_device_name() const {
-    __snd_ctl_t_raai snd_ctl_handle = card_handle();
+  static int _set_scheduling(pthread_t thread, int sched_policy, int priority) {
+    sched_param param = {};
+    param.sched_priority = priority;
+    return pthread_setschedparam(thread, sched_policy, &param);
+  }
 
-    __snd_pcm_info_t_raai pcm_info = get_pcm_info();
-    int result = snd_ctl_pcm_info(snd_ctl_handle.get(), pcm_info.get());
-    if (result < 0)
-      return string();
+  static void _record_error(audio_thread_policy_status& status, int error) {
+    if (status.error == 0)
+      status.error = error;
+  }
+};
 
-    string card_name = get_card_name(snd_ctl_handle);
+enum class audio_device_event_type {
+  xrun,
+  suspend,
+  state_changed,
+  sample_rate_changed,
+  error,
+  stopped
+};
 
-    const char * pcm_name = snd_pcm_info_get_name(pcm_info.get());
-    if (!pcm_name)
-      return string();
+// Diagnostic raised by the processing thread. code is the (negative) ALSA
+// error for xrun, suspend and error events, the snd_pcm_state_t for
+// state_changed events, and the new rate for sample_rate_changed events,
+// which a running device raises when set_sample_rate switched it over.
+// A stopped event (code 0) follows the event of an error the processing
+// thread could not recover from: the device is no longer running.
+struct audio_device_event {
+  audio_device_event_type type = audio_device_event_type::error;
+  int code = 0;
+  chrono::time_point<audio_clock_t> time = {};
+};
 
-    return card_name + ", " + pcm_name;
-  }
+// Single-producer single-consumer ring. push() is wait-free and never
+// allocates, so it is safe to call from the processing thread.
+template <typename _ValueType, size_t _Capacity>
+class __alsa_spsc_ring {
+  static_assert((_Capacity & (_Capacity - 1)) == 0, "capacity must be a power of two");
 
-  __snd_pcm_t_raai get_pcm() const {
-    snd_pcm_t* pcm_t_raw {};
-    __alsa_util::check_error(snd_pcm_open(&pcm_t_raw, get_device_id_str().c_str(), SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK | SND_PCM_NO_AUTO_RESAMPLE | SND_PCM_NO_AUTO_CHANNELS | SND_PCM_NO_AUTO_FORMAT));
-    return __snd_pcm_t_raai(pcm_t_raw);
-  }
+public:
+  bool push(const _ValueType& value) noexcept {
+    const size_t tail = _tail.load(memory_order_relaxed);
+    if (tail - _head.load(memory_order_acquire) == _Capacity)
+      return false;
 
-  __snd_pcm_hw_params_raai get_hw_params() const {
-    snd_pcm_hw_params_t* hw_params_raw {};
-    snd_pcm_hw_params_malloc(&hw_params_raw);
-    return __snd_pcm_hw_params_raai(hw_params_raw);
+    _values[tail & (_Capacity - 1)] = value;
+    _tail.store(tail + 1, memory_order_release);
+    return true;
   }
 
-  __snd_ctl_t_raai card_handle() const {
-    snd_ctl_t *raw_handle;
-    int result = snd_ctl_open(&raw_handle, get_card_str_id().c_str(), 0);
-    if (result < 0)
-      return nullptr;
+  bool pop(_ValueType& value) noexcept {
+    const size_t head = _head.load(memory_order_relaxed);
+    if (head == _tail.load(memory_order_acquire))
+      return false;
 
-    return __snd_ctl_t_raai(raw_handle);
+    value = _values[head & (_Capacity - 1)];
+    _head.store(head + 1, memory_order_release);
+    return true;
   }
 
-  bool operator==(const __alsa_audio_device_id& rhs) {
-    return device_id == rhs.device_id && card_id == rhs.card_id;
-  }
+private:
+  array<_ValueType, _Capacity> _values = {};
+  alignas(64) atomic<size_t> _head = 0;
+  alignas(64) atomic<size_t> _tail = 0;
 };
 
-using __audio_device_id = __alsa_audio_device_id;
-
-class audio_device {
+// Owns the event ring written by the processing thread and a low priority
+// thread that drains it into the user supplied sink, so that reporting an
+// error never blocks the audio callback. The thread sleeps on an eventfd
+// that post() signals, so an idle device costs it no wakeups.
+class __alsa_event_reporter {
 public:
-  audio_device() = delete;
-  audio_device(const audio_device&) = delete;
-  audio_device& operator=(const audio_device&) = delete;
-  audio_device(audio_device&& other)
-      : _access_type(other._access_type)
-      , _sample_rate(other._sample_rate)
-      , _audio_format(other._audio_format)
-      , _buffer_size_frames(other._buffer_size_frames)
-      , _poll_fd(move(other._poll_fd))
-      , _supported_sample_rates(move(other._supported_sample_rates))
-      , _supported_audio_formats(move(other._supported_audio_formats))
-      , _min_supported_buffer_size(other._min_supported_buffer_size)
-      , _max_supported_buffer_size(other._max_supported_buffer_size)
-      , _device_id(other._device_id)
-      , _device_pcm(move(other._device_pcm))
-      , _hw_params(move(other._hw_params))
-      , _processing_thread(move(other._processing_thread))
-      , _name(move(other._name))
-      , _config(other._config)
-  {}
+  using sink_t = function<void(const audio_device_event&)>;
 
-  audio_device& operator=(audio_device&& other) noexcept {
-    _access_type = other._access_type;
-    _sample_rate = other._sample_rate;
-    _audio_format = other._audio_format;
-    _buffer_size_frames = other._buffer_size_frames;
-    _poll_fd = move(other._poll_fd);
-    _supported_sample_rates = move(other._supported_sample_rates);
-    _supported_audio_formats = move(other._supported_audio_formats);
-    _min_supported_buffer_size = other._min_supported_buffer_size;
-    _max_supported_buffer_size = other._max_supported_buffer_size;
-    _device_id = other._device_id;
-    _device_pcm = move(other._device_pcm);
-    _hw_params = move(other._hw_params);
-    _processing_thread = move(other._processing_thread);
-    _name = move(other._name);
-    _config = other._config;
-    return *this;
+  explicit __alsa_event_reporter(sink_t sink)
+    : _sink(move(sink)),
+      _event_fd(eventfd(0, EFD_CLOEXEC)) {
   }
 
-  ~audio_device() {
+  ~__alsa_event_reporter() {
     stop();
+    if (_event_fd >= 0)
+      close(_event_fd);
   }
 
-  string_view name() const noexcept {
-    return _name;
+  // A write to the eventfd, which never blocks.
+  void post(audio_device_event_type type, int code) noexcept {
+    if (!_events.push({type, code, audio_clock_t::now()}))
+      _dropped_events.fetch_add(1, memory_order_relaxed);
+    _signal();
   }
 
-  using device_id_t = __alsa_audio_device_id;
+  // Without an eventfd there is nothing to wait on, and events are dropped
+  // once the ring is full.
+  void start() {
+    if (_thread.joinable() || _event_fd < 0)
+      return;
 
-  device_id_t device_id() const noexcept {
-    return _device_id;
+    _stopping.store(false, memory_order_relaxed);
+    _thread = thread(&__alsa_event_reporter::_run, this);
   }
 
-  bool is_input() const noexcept {
-    return get_num_input_channels() > 0;
+  void stop() {
+    if (!_thread.joinable())
+      return;
+
+    _stopping.store(true, memory_order_release);
+    _signal();
+    _thread.join();
   }
 
-  bool is_output() const noexcept {
-    return get_num_output_channels() > 0;
+  size_t dropped_events() const noexcept {
+    return _dropped_events.load(memory_order_relaxed);
   }
 
-  int get_num_input_channels() const noexcept {
-    return _config.input_config;
+  static string format_event(const audio_device_event& event) {
+    switch (event.type) {
+    case audio_device_event_type::xrun:
+      return string("xrun: ") + snd_strerror(event.code);
+    case audio_device_event_type::suspend:
+      return string("suspend: ") + snd_strerror(event.code);
+    case audio_device_event_type::state_changed:
+      return string("state changed: ") + snd_pcm_state_name(static_cast<snd_pcm_state_t>(event.code));
+    case audio_device_event_type::sample_rate_changed:
+      return string("sample rate changed: ") + to_string(event.code);
+    case audio_device_event_type::stopped:
+      return "stopped";
+    case audio_device_event_type::error:
+    default:
+      return string("error: ") + snd_strerror(event.code);
+    }
   }
 
-  int get_num_output_channels() const noexcept {
-    return _config.output_config;
+  static void log_event(const audio_device_event& event) {
+    cerr << "__alsa_backend " << format_event(event) << '\n';
   }
 
-  using sample_rate_t = unsigned int;
+private:
+  void _signal() noexcept {
+    if (_event_fd >= 0) {
+      const uint64_t value = 1;
+      ssize_t written = write(_event_fd, &value, sizeof(value));
+      (void)written;
+    }
+  }
 
-  sample_rate_t get_sample_rate() const noexcept {
-    return _sample_rate;
-    __snd_pcm_hw_params_raai hw_params = _device_id.get_hw_params();
+  // Drains once more after stop(), for events posted just before it.
+  void _run() {
+    while (true) {
+      uint64_t value = 0;
+      if (read(_event_fd, &value, sizeof(value)) < 0 && errno != EINTR)
+        return;
 
-    __snd_pcm_helper pcm(this);
+      _drain();
+      if (_stopping.load(memory_order_acquire)) {
+        _drain();
+        return;
+      }
+    }
+  }
 
-    sample_rate_t rate = 44100;
-    int direction = SND_PCM_STREAM_PLAYBACK;
+  void _drain() {
+    audio_device_event event;
+    while (_events.pop(event)) {
+      if (_sink)
+        _sink(event);
+    }
+  }
 
-    if (!__alsa_util::check_error(snd_pcm_hw_params_any(pcm.get(), hw_params.get())))
-      return {};
+  __alsa_spsc_ring<audio_device_event, 256> _events;
+  atomic<size_t> _dropped_events = 0;
+  sink_t _sink;
+  int _event_fd = -1;
+  thread _thread;
+  atomic<bool> _stopping = false;
+};
 
-    if (!__alsa_util::check_error( snd_pcm_hw_params_set_rate_resample	(pcm.get(), hw_params.get(), false)))
-      return {};
+// Health of a running device, as counted by its processing thread.
+struct audio_device_stats {
+  uint64_t xruns = 0;
+  uint64_t suspends = 0;
+  // rewind_output requests that moved the playback ring back, and by how
+  // many frames in all; those frames are also processed again
+  uint64_t rewinds = 0;
+  uint64_t frames_rewound = 0;
+  uint64_t frames_processed = 0;
+  uint64_t callbacks = 0;
+  // every time the processing thread woke up, whether or not it had work
+  uint64_t wakeups = 0;
+  // Calls the processing thread made that always enter the kernel: poll,
+  // ioctls such as hwsync and start, and RW transfers. Reading the hardware
+  // pointer and the state of a hw PCM costs none where the kernel maps
+  // the status and control pages, and is not counted.
+  uint64_t system_calls = 0;
+  chrono::nanoseconds min_callback_duration = {};
+  chrono::nanoseconds average_callback_duration = {};
+  chrono::nanoseconds max_callback_duration = {};
+  // from poll() returning to the first callback of that wakeup
+  chrono::nanoseconds average_wakeup_latency = {};
+  chrono::nanoseconds max_wakeup_latency = {};
+  // From the driver's timestamp of the pointer update that made a period
+  // available to the processing thread seeing it, and the standard
+  // deviation of that delay. Needs hardware timestamps, and is not measured
+  // with timer scheduling, where the thread itself syncs the pointer.
+  chrono::nanoseconds average_wakeup_delay = {};
+  chrono::nanoseconds max_wakeup_delay = {};
+  chrono::nanoseconds wakeup_jitter = {};
+  // callback time divided by the duration of the frames it processed
+  double average_dsp_load = 0;
+  double max_dsp_load = 0;
+  // From start() to the first frame the hardware played or captured, dated
+  // by the driver's timestamp. Zero until known. Measured once per start
+  // and kept by reset_stats.
+  chrono::nanoseconds time_to_first_frame = {};
+};
 
-    if (!__alsa_util::check_error(snd_pcm_hw_params_set_rate_near(pcm.get(), hw_params.get(), &rate, &direction)))
-      return {};
+// Only the processing thread writes. Readers take a consistent snapshot
+// through a sequence lock: they retry instead of ever making the writer
+// wait, and a reset is only requested, then carried out by the writer.
+class __alsa_stats_recorder {
+public:
+  void record_xrun() noexcept {
+    _update([this] { _store(_xruns, _load(_xruns) + 1); });
+  }
 
-    if (!__alsa_util::check_error(snd_pcm_hw_params (pcm.get(), hw_params.get())))
-      return {};
+  void record_suspend() noexcept {
+    _update([this] { _store(_suspends, _load(_suspends) + 1); });
+  }
 
-    if (!__alsa_util::check_error(snd_pcm_hw_params_get_rate(hw_params.get(), &rate, &direction)))
-      return {};
+  void record_rewind(uint64_t frames) noexcept {
+    _update([this, frames] {
+      _store(_rewinds, _load(_rewinds) + 1);
+      _store(_frames_rewound, _load(_frames_rewound) + frames);
+    });
+  }
 
-    return rate;
+  void record_wakeup(chrono::time_point<audio_clock_t> time) noexcept {
+    _wakeup_time = time;
+    _wakeup_pending = true;
+    _update([this] { _store(_wakeups, _load(_wakeups) + 1); });
   }
-/*
-  bool set_sample_rate(sample_rate_t new_sample_rate) {
-    AudioObjectPropertyAddress pa = {
-      kAudioDevicePropertyNominalSampleRate,
-      kAudioObjectPropertyScopeGlobal,
-      kAudioObjectPropertyElementMaster
-    };
 
-    return __coreaudio_util::check_error(AudioObjectSetPropertyData(
-      _device_id, &pa, 0, nullptr, sizeof(sample_rate_t), &new_sample_rate));
+  void record_callback(chrono::time_point<audio_clock_t> start, chrono::time_point<audio_clock_t> end,
+                       uint64_t frames, unsigned int sample_rate) noexcept {
+    const uint64_t duration = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+    const uint64_t period = sample_rate > 0 ? frames * 1'000'000'000 / sample_rate : 0;
+    const double load = period > 0 ? static_cast<double>(duration) / static_cast<double>(period) : 0;
+
+    uint64_t latency = 0;
+    const bool first_after_wakeup = exchange(_wakeup_pending, false);
+    if (first_after_wakeup)
+      latency = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(start - _wakeup_time).count());
+
+    _update([&] {
+      const uint64_t callbacks = _load(_callbacks);
+      _store(_callbacks, callbacks + 1);
+      _store(_frames_processed, _load(_frames_processed) + frames);
+      _store(_total_callback_ns, _load(_total_callback_ns) + duration);
+      _store(_total_period_ns, _load(_total_period_ns) + period);
+      _store(_min_callback_ns, callbacks == 0 ? duration : min(_load(_min_callback_ns), duration));
+      _store(_max_callback_ns, max(_load(_max_callback_ns), duration));
+      _max_dsp_load.store(max(_max_dsp_load.load(memory_order_relaxed), load), memory_order_relaxed);
+      if (first_after_wakeup) {
+        _store(_timed_wakeups, _load(_timed_wakeups) + 1);
+        _store(_total_wakeup_ns, _load(_total_wakeup_ns) + latency);
+        _store(_max_wakeup_ns, max(_load(_max_wakeup_ns), latency));
+      }
+    });
   }
-*/
-  using buffer_size_t = snd_pcm_uframes_t;
-  snd_pcm_format_t get_audio_format() const noexcept {
 
-    if (_device_pcm.get()) {
-      __snd_pcm_hw_params_raai hw_params = _device_id.get_hw_params();
+  void record_wakeup_delay(chrono::nanoseconds delay) noexcept {
+    const uint64_t delay_ns = static_cast<uint64_t>(max<chrono::nanoseconds::rep>(delay.count(), 0));
+    _update([this, delay_ns] {
+      _store(_delayed_wakeups, _load(_delayed_wakeups) + 1);
+      _store(_total_delay_ns, _load(_total_delay_ns) + delay_ns);
+      _store(_max_delay_ns, max(_load(_max_delay_ns), delay_ns));
+      const double delay = static_cast<double>(delay_ns);
+      _delay_square_sum.store(_delay_square_sum.load(memory_order_relaxed) + delay * delay, memory_order_relaxed);
+    });
+  }
 
-      if (!__alsa_util::check_error(
-              snd_pcm_hw_params_any(_device_pcm.get(), hw_params.get())))
-        return {};
+  // Published with the next update, so counting costs no atomic operations.
+  void count_system_calls(uint64_t count) noexcept {
+    _unpublished_system_calls += count;
+  }
 
-      snd_pcm_format_t format;
-      __alsa_util::check_error(
-          snd_pcm_hw_params_get_format(hw_params.get(), &format));
+  void record_first_frame(chrono::nanoseconds time) noexcept {
+    _update([this, time] { _store(_first_frame_ns, static_cast<uint64_t>(time.count())); });
+  }
 
-      return format;
-    }
+  void request_reset() noexcept {
+    _reset_requested.store(true, memory_order_relaxed);
+  }
 
-    return _audio_format;
+  // Only when no processing thread is running.
+  void reset() noexcept {
+    _reset_requested.store(true, memory_order_relaxed);
+    _update([] {});
   }
 
+  audio_device_stats snapshot() const noexcept {
+    audio_device_stats stats;
+    uint64_t total_callback_ns, total_period_ns, timed_wakeups, total_wakeup_ns;
+    uint64_t delayed_wakeups, total_delay_ns;
+    double delay_square_sum;
+    uint64_t before, after;
+    do {
+      before = _sequence.load(memory_order_acquire);
+      stats.xruns = _load(_xruns);
+      stats.suspends = _load(_suspends);
+      stats.rewinds = _load(_rewinds);
+      stats.frames_rewound = _load(_frames_rewound);
+      stats.frames_processed = _load(_frames_processed);
+      stats.callbacks = _load(_callbacks);
+      stats.wakeups = _load(_wakeups);
+      stats.system_calls = _load(_system_calls);
+      stats.min_callback_duration = chrono::nanoseconds(_load(_min_callback_ns));
+      stats.max_callback_duration = chrono::nanoseconds(_load(_max_callback_ns));
+      stats.max_wakeup_latency = chrono::nanoseconds(_load(_max_wakeup_ns));
+      stats.max_dsp_load = _max_dsp_load.load(memory_order_relaxed);
+      stats.time_to_first_frame = chrono::nanoseconds(_load(_first_frame_ns));
+      total_callback_ns = _load(_total_callback_ns);
+      total_period_ns = _load(_total_period_ns);
+      timed_wakeups = _load(_timed_wakeups);
+      total_wakeup_ns = _load(_total_wakeup_ns);
+      stats.max_wakeup_delay = chrono::nanoseconds(_load(_max_delay_ns));
+      delayed_wakeups = _load(_delayed_wakeups);
+      total_delay_ns = _load(_total_delay_ns);
+      delay_square_sum = _delay_square_sum.load(memory_order_relaxed);
+      atomic_thread_fence(memory_order_acquire);
+      after = _sequence.load(memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+
+    if (stats.callbacks > 0)
+      stats.average_callback_duration = chrono::nanoseconds(total_callback_ns / stats.callbacks);
+    if (timed_wakeups > 0)
+      stats.average_wakeup_latency = chrono::nanoseconds(total_wakeup_ns / timed_wakeups);
+    if (total_period_ns > 0)
+      stats.average_dsp_load = static_cast<double>(total_callback_ns) / static_cast<double>(total_period_ns);
+    if (delayed_wakeups > 0) {
+      const double mean = static_cast<double>(total_delay_ns) / static_cast<double>(delayed_wakeups);
+      const double variance = delay_square_sum / static_cast<double>(delayed_wakeups) - mean * mean;
+      stats.average_wakeup_delay = chrono::nanoseconds(static_cast<chrono::nanoseconds::rep>(mean));
+      stats.wakeup_jitter = chrono::nanoseconds(static_cast<chrono::nanoseconds::rep>(sqrt(max(variance, 0.0))));
+    }
+    return stats;
+  }
 
-  buffer_size_t get_buffer_size_frames() const noexcept {
+private:
+  using __counter_t = atomic<uint64_t>;
 
-    __snd_pcm_hw_params_raai hw_params = _device_id.get_hw_params();
-    __snd_pcm_helper pcm(this);
+  static uint64_t _load(const __counter_t& counter) noexcept {
+    return counter.load(memory_order_relaxed);
+  }
 
-    if (!__alsa_util::check_error(snd_pcm_hw_params_any(pcm.get(), hw_params.get())))
-      return {};
+  static void _store(__counter_t& counter, uint64_t value) noexcept {
+    counter.store(value, memory_order_relaxed);
+  }
+
+  template <typename _Function>
+  void _update(_Function&& function) noexcept {
+    const uint64_t sequence = _sequence.load(memory_order_relaxed);
+    _sequence.store(sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    if (_reset_requested.exchange(false, memory_order_relaxed)) {
+      for (__counter_t* counter : {&_xruns, &_suspends, &_rewinds, &_frames_rewound, &_frames_processed,
+                                   &_callbacks, &_total_callback_ns, &_total_period_ns, &_min_callback_ns,
+                                   &_max_callback_ns, &_wakeups, &_timed_wakeups, &_total_wakeup_ns,
+                                   &_max_wakeup_ns, &_system_calls, &_delayed_wakeups, &_total_delay_ns,
+                                   &_max_delay_ns})
+        _store(*counter, 0);
+      _max_dsp_load.store(0, memory_order_relaxed);
+      _delay_square_sum.store(0, memory_order_relaxed);
+    }
+
+    if (_unpublished_system_calls > 0)
+      _store(_system_calls, _load(_system_calls) + exchange(_unpublished_system_calls, 0));
+
+    function();
+    _sequence.store(sequence + 2, memory_order_release);
+  }
+
+  atomic<uint64_t> _sequence = 0;
+  atomic<bool> _reset_requested = false;
+  __counter_t _xruns = 0;
+  __counter_t _suspends = 0;
+  __counter_t _rewinds = 0;
+  __counter_t _frames_rewound = 0;
+  __counter_t _frames_processed = 0;
+  __counter_t _callbacks = 0;
+  __counter_t _total_callback_ns = 0;
+  __counter_t _total_period_ns = 0;
+  __counter_t _min_callback_ns = 0;
+  __counter_t _max_callback_ns = 0;
+  __counter_t _wakeups = 0;
+  // wakeups followed by a callback, which the latency is measured on
+  __counter_t _timed_wakeups = 0;
+  __counter_t _total_wakeup_ns = 0;
+  __counter_t _max_wakeup_ns = 0;
+  __counter_t _system_calls = 0;
+  __counter_t _delayed_wakeups = 0;
+  __counter_t _total_delay_ns = 0;
+  __counter_t _max_delay_ns = 0;
+  atomic<double> _delay_square_sum = 0;
+  atomic<double> _max_dsp_load = 0;
+  // not reset: it is only measured right after start
+  __counter_t _first_frame_ns = 0;
+
+  // processing thread only
+  chrono::time_point<audio_clock_t> _wakeup_time = {};
+  bool _wakeup_pending = false;
+  uint64_t _unpublished_system_calls = 0;
+};
+
+// An eventfd that wakes a processing thread out of poll(). Its owner keeps
+// it for its whole lifetime, so other threads can wake() it at any time,
+// even while the poll descriptors that watch it are being set up again.
+class __alsa_wake_event {
+public:
+  __alsa_wake_event()
+    : _fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+  }
+
+  __alsa_wake_event(const __alsa_wake_event&) = delete;
+  __alsa_wake_event& operator=(const __alsa_wake_event&) = delete;
+
+  __alsa_wake_event(__alsa_wake_event&& other) noexcept
+    : _fd(exchange(other._fd, -1)) {
+  }
+
+  __alsa_wake_event& operator=(__alsa_wake_event&& other) noexcept {
+    if (this != &other) {
+      _close();
+      _fd = exchange(other._fd, -1);
+    }
+    return *this;
+  }
+
+  ~__alsa_wake_event() {
+    _close();
+  }
+
+  // Makes the current and every later wait on fd() return straight away.
+  void wake() const noexcept {
+    if (_fd >= 0) {
+      const uint64_t value = 1;
+      ssize_t written = write(_fd, &value, sizeof(value));
+      (void)written;
+    }
+  }
+
+  // Undoes wake(), so that the next wait sleeps again.
+  void clear() const noexcept {
+    if (_fd >= 0) {
+      uint64_t value = 0;
+      ssize_t read_size = read(_fd, &value, sizeof(value));
+      (void)read_size;
+    }
+  }
+
+  int fd() const noexcept {
+    return _fd;
+  }
+
+  bool is_open() const noexcept {
+    return _fd >= 0;
+  }
+
+private:
+  void _close() noexcept {
+    if (_fd >= 0)
+      close(_fd);
+    _fd = -1;
+  }
+
+  int _fd = -1;
+};
+
+// Waits on the poll descriptors of one or more PCMs (the capture and playback
+// halves of a duplex device) until every one of them is ready, or until
+// their owner's __alsa_wake_event is woken.
+class __alsa_pollfd {
+
+private:
+  struct __pcm_entry {
+    snd_pcm_t* pcm = nullptr;
+    size_t first_fd = 0;
+    size_t fd_count = 0;
+    short ready_event = 0;
+  };
+
+  std::vector<pollfd> _poll_fd;
+  std::vector<short> _events;
+  std::vector<__pcm_entry> _pcms;
+
+  // the owner's __alsa_wake_event, polled alongside the PCMs; not owned
+  int _wake_fd = -1;
+
+  // poll() and ppoll() calls not yet collected by take_system_calls()
+  uint64_t _system_calls = 0;
+
+  friend std::optional<__alsa_pollfd> __make_alsa_pollfd(const std::vector<snd_pcm_t*>& pcms,
+                                                         const __alsa_wake_event& wake_event);
+
+public:
+  __alsa_pollfd() = default;
+
+  __alsa_pollfd(const __alsa_pollfd&) = delete;
+  __alsa_pollfd& operator=(const __alsa_pollfd&) = delete;
+
+  __alsa_pollfd(__alsa_pollfd&& other) noexcept
+    : _poll_fd(move(other._poll_fd)),
+      _events(move(other._events)),
+      _pcms(move(other._pcms)),
+      _wake_fd(exchange(other._wake_fd, -1)),
+      _system_calls(exchange(other._system_calls, 0)) {
+  }
+
+  __alsa_pollfd& operator=(__alsa_pollfd&& other) noexcept {
+    if (this != &other) {
+      _poll_fd = move(other._poll_fd);
+      _events = move(other._events);
+      _pcms = move(other._pcms);
+      _wake_fd = exchange(other._wake_fd, -1);
+      _system_calls = exchange(other._system_calls, 0);
+    }
+    return *this;
+  }
+
+  // Sleeps on the wakeup eventfd alone, for timer scheduling. Returns 0
+  // once the timeout expired or a signal arrived, 1 when woken and -1 on
+  // error.
+  int wait_for(chrono::nanoseconds timeout)
+  {
+    pollfd& wake_fd = _poll_fd.back();
+    wake_fd.events = POLLIN;
+
+    const auto seconds = chrono::duration_cast<chrono::seconds>(timeout);
+    const timespec timeout_spec = {static_cast<time_t>(seconds.count()), static_cast<long>((timeout - seconds).count())};
+
+    ++_system_calls;
+    int result = ppoll(&wake_fd, 1, &timeout_spec, nullptr);
+    if (result < 0)
+      return errno == EINTR ? 0 : -1;
+
+    return result > 0 ? 1 : 0;
+  }
+
+  // Returns 0 once every PCM is ready, 1 when woken and -1 on error.
+  int wait()
+  {
+    for (size_t i = 0; i < _poll_fd.size(); ++i)
+      _poll_fd[i].events = _events[i];
+
+    size_t pending = _pcms.size();
+    while (true) {
+      ++_system_calls;
+      int result = poll(_poll_fd.data(), _poll_fd.size(), -1);
+      if (result < 0) {
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+
+      if (_poll_fd.back().revents & POLLIN)
+        return 1;
+
+      for (auto& entry : _pcms) {
+        pollfd* fds = _poll_fd.data() + entry.first_fd;
+        if (fds[0].events == 0)
+          continue;
+
+        unsigned short revents;
+        result = snd_pcm_poll_descriptors_revents(entry.pcm, fds, entry.fd_count, &revents);
+        if (result < 0) {
+          return -1;
+        }
+        if (revents & (POLLERR | POLLNVAL | POLLHUP)) {
+          return 0;
+        }
+        if (revents & entry.ready_event) {
+          // stop polling this PCM until the others have caught up
+          for (size_t i = 0; i < entry.fd_count; ++i)
+            fds[i].events = 0;
+          --pending;
+        }
+      }
+
+      if (pending == 0)
+        return 0;
+    }
+  }
+
+  uint64_t take_system_calls() noexcept {
+    return exchange(_system_calls, 0);
+  }
+
+  bool is_open() const noexcept {
+    return _wake_fd >= 0;
+  }
+};
+
+inline std::optional<__alsa_pollfd> __make_alsa_pollfd(const std::vector<snd_pcm_t*>& pcms,
+                                                       const __alsa_wake_event& wake_event) {
+  if (!wake_event.is_open())
+    return nullopt;
+
+  __alsa_pollfd pollfd;
+
+  for (snd_pcm_t* pcm : pcms) {
+    if (!pcm)
+      continue;
+
+    int count = snd_pcm_poll_descriptors_count(pcm);
+    if (count <= 0)
+      return nullopt;
+
+    __alsa_pollfd::__pcm_entry entry;
+    entry.pcm = pcm;
+    entry.first_fd = pollfd._poll_fd.size();
+    entry.fd_count = static_cast<size_t>(count);
+    entry.ready_event = snd_pcm_stream(pcm) == SND_PCM_STREAM_CAPTURE ? POLLIN : POLLOUT;
+
+    pollfd._poll_fd.resize(entry.first_fd + entry.fd_count);
+    int result = snd_pcm_poll_descriptors(pcm, pollfd._poll_fd.data() + entry.first_fd, count);
+    if (result < 0)
+      return nullopt;
+
+    pollfd._pcms.push_back(entry);
+  }
+
+  if (pollfd._pcms.empty())
+    return nullopt;
+
+  pollfd._wake_fd = wake_event.fd();
+  pollfd._poll_fd.push_back({pollfd._wake_fd, POLLIN, 0});
+
+  for (const auto& fd : pollfd._poll_fd)
+    pollfd._events.push_back(fd.events);
+
+  return pollfd;
+}
+
+struct audio_device_exception : public runtime_error {
+  explicit audio_device_exception(const char* what)
+    : runtime_error(what) {
+  }
+};
+
+// A hardware device (hw:card,device), or any PCM ALSA can open by name,
+// e.g. default, dmix, null or a file plugin, when pcm_name is set.
+struct __alsa_audio_device_id
+{
+  int card_id {-1};
+  int device_id {-1};
+  string pcm_name = {};
+
+  bool is_named() const noexcept {
+    return !pcm_name.empty();
+  }
+
+  string get_card_str_id() const {
+    return string("hw:") + to_string(card_id);
+  }
+
+  __snd_ctl_card_info_raai get_card_info() const {
+    snd_ctl_card_info_t* card_info_raw = {nullptr};
+
+    snd_ctl_card_info_malloc(&card_info_raw);
+    return __snd_ctl_card_info_raai(card_info_raw);
+  }
+
+  __snd_pcm_info_t_raai get_pcm_info(snd_pcm_stream_t stream = SND_PCM_STREAM_PLAYBACK) const {
+    snd_pcm_info_t* pcm_info_raw = {nullptr};
+    snd_pcm_info_malloc(&pcm_info_raw);
+
+    if (pcm_info_raw) {
+      snd_pcm_info_set_device(pcm_info_raw, device_id);
+      snd_pcm_info_set_subdevice(pcm_info_raw, 0);
+      snd_pcm_info_set_stream(pcm_info_raw, stream);
+    }
+
+    return __snd_pcm_info_t_raai(pcm_info_raw);
+  }
+
+  string get_card_name(__snd_ctl_t_raai& snd_ctl_handle) const {
+    __snd_ctl_card_info_raai card_info = get_card_info();
+    if (!card_info)
+      return string();
+
+    int result = snd_ctl_card_info(snd_ctl_handle.get(), card_info.get());
+    if (result < 0)
+      return string();
+
+    string card_name = snd_ctl_card_info_get_name(card_info.get());
+    return card_name;
+  }
+
+  string get_device_id_str() const {
+    if (is_named())
+      return pcm_name;
+
+    return get_card_str_id() + ',' + to_string(device_id);
+  }
+
+  string get_device_name() const {
+    if (is_named())
+      return pcm_name;
+
+    __snd_ctl_t_raai snd_ctl_handle = card_handle();
+    return get_device_name(snd_ctl_handle);
+  }
+
+  // Takes the card's control handle so callers can share one across devices.
+  string get_device_name(__snd_ctl_t_raai& snd_ctl_handle) const {
+    // capture-only devices have no playback pcm info
+    __snd_pcm_info_t_raai pcm_info = get_pcm_info(SND_PCM_STREAM_PLAYBACK);
+    int result = snd_ctl_pcm_info(snd_ctl_handle.get(), pcm_info.get());
+    if (result < 0) {
+      pcm_info = get_pcm_info(SND_PCM_STREAM_CAPTURE);
+      result = snd_ctl_pcm_info(snd_ctl_handle.get(), pcm_info.get());
+    }
+    if (result < 0)
+      return string();
+
+    string card_name = get_card_name(snd_ctl_handle);
+
+    const char * pcm_name = snd_pcm_info_get_name(pcm_info.get());
+    if (!pcm_name)
+      return string();
+
+    return card_name + ", " + pcm_name;
+  }
+
+  // Named PCMs keep the conversions their plugin chain was set up with.
+  __snd_pcm_t_raai get_pcm(snd_pcm_stream_t stream = SND_PCM_STREAM_PLAYBACK) const {
+    const int mode = is_named()
+      ? SND_PCM_NONBLOCK
+      : SND_PCM_NONBLOCK | SND_PCM_NO_AUTO_RESAMPLE | SND_PCM_NO_AUTO_CHANNELS | SND_PCM_NO_AUTO_FORMAT;
+    snd_pcm_t* pcm_t_raw {};
+    __alsa_util::check_error(snd_pcm_open(&pcm_t_raw, get_device_id_str().c_str(), stream, mode));
+    return __snd_pcm_t_raai(pcm_t_raw);
+  }
+
+  __snd_pcm_hw_params_raai get_hw_params() const {
+    snd_pcm_hw_params_t* hw_params_raw {};
+    snd_pcm_hw_params_malloc(&hw_params_raw);
+    return __snd_pcm_hw_params_raai(hw_params_raw);
+  }
+
+  // Named PCMs have no card of their own.
+  __snd_ctl_t_raai card_handle() const {
+    if (is_named())
+      return nullptr;
+
+    snd_ctl_t *raw_handle;
+    int result = snd_ctl_open(&raw_handle, get_card_str_id().c_str(), 0);
+    if (result < 0)
+      return nullptr;
+
+    return __snd_ctl_t_raai(raw_handle);
+  }
+
+  bool operator==(const __alsa_audio_device_id& rhs) const {
+    return device_id == rhs.device_id && card_id == rhs.card_id && pcm_name == rhs.pcm_name;
+  }
+
+  bool operator<(const __alsa_audio_device_id& rhs) const {
+    return tie(card_id, device_id, pcm_name) < tie(rhs.card_id, rhs.device_id, rhs.pcm_name);
+  }
+};
+
+using __audio_device_id = __alsa_audio_device_id;
+
+// Sample types a callback can be connected with, and the PCM format that
+// carries each of them without conversion.
+template <typename _SampleType>
+inline constexpr snd_pcm_format_t __alsa_native_format = SND_PCM_FORMAT_UNKNOWN;
+
+template <>
+inline constexpr snd_pcm_format_t __alsa_native_format<float> = SND_PCM_FORMAT_FLOAT_LE;
+
+template <>
+inline constexpr snd_pcm_format_t __alsa_native_format<int32_t> = SND_PCM_FORMAT_S32_LE;
+
+template <>
+inline constexpr snd_pcm_format_t __alsa_native_format<int16_t> = SND_PCM_FORMAT_S16_LE;
+
+// Converts between the callback's sample type and the format the PCM was
+// opened in. Contiguous runs, which is what an interleaved mmap ring hands
+// out, are converted four or eight samples at a time with SSE2 where that
+// beats the compiler; the scalar conversion is the reference and handles the
+// tails.
+class __alsa_sample_converter {
+public:
+  template <typename _From, typename _To>
+  static _To convert_sample(_From sample) noexcept {
+    if constexpr (is_same_v<_From, _To>) {
+      return sample;
+    } else if constexpr (is_same_v<_To, float>) {
+      return static_cast<float>(sample) * _to_float_scale<_From>;
+    } else if constexpr (is_same_v<_From, float>) {
+      // Clamp first: out of range floats are undefined when cast to
+      // integers. NaN fails the comparison and becomes -1, as in the SSE2
+      // path, where maxps returns its second operand.
+      const float clamped = sample >= -1.0f ? min(sample, _max_float_sample) : -1.0f;
+      return static_cast<_To>(clamped * _from_float_scale<_To>);
+    } else if constexpr (is_same_v<_From, int16_t>) {
+      return static_cast<int32_t>(sample) * 65536;
+    } else {
+      return static_cast<int16_t>(sample >> 16);
+    }
+  }
+
+  template <typename _From, typename _To>
+  static void convert(const _From* source, _To* destination, size_t count) noexcept {
+    if constexpr (is_same_v<_From, _To>) {
+      memcpy(destination, source, count * sizeof(_To));
+    } else {
+      size_t converted = 0;
+#if defined(__SSE2__)
+      converted = _convert_sse2(source, destination, count);
+#endif
+      for (; converted < count; ++converted)
+        destination[converted] = convert_sample<_From, _To>(source[converted]);
+    }
+  }
+
+private:
+  template <typename _SampleType>
+  inline static constexpr float _to_float_scale = is_same_v<_SampleType, int16_t> ? 1.0f / 32768.0f : 1.0f / 2147483648.0f;
+
+  template <typename _SampleType>
+  inline static constexpr float _from_float_scale = is_same_v<_SampleType, int16_t> ? 32768.0f : 2147483648.0f;
+
+  // the largest float below 1.0, so that full scale does not overflow int32
+  inline static constexpr float _max_float_sample = 0x1.fffffep-1f;
+
+#if defined(__SSE2__)
+  // Integer to float conversion is left to the compiler, which vectorises
+  // the scalar loop at least as well. Float to integer is not vectorised
+  // automatically because of the clamp.
+  template <typename _From, typename _To>
+  static size_t _convert_sse2(const _From*, _To*, size_t) noexcept {
+    return 0;
+  }
+
+  static __m128 _clamp(__m128 samples) noexcept {
+    return _mm_min_ps(_mm_max_ps(samples, _mm_set1_ps(-1.0f)), _mm_set1_ps(_max_float_sample));
+  }
+
+  static size_t _convert_sse2(const float* source, int16_t* destination, size_t count) noexcept {
+    const __m128 scale = _mm_set1_ps(_from_float_scale<int16_t>);
+    const size_t vectorised = count - count % 8;
+    for (size_t i = 0; i < vectorised; i += 8) {
+      __m128i low = _mm_cvttps_epi32(_mm_mul_ps(_clamp(_mm_loadu_ps(source + i)), scale));
+      __m128i high = _mm_cvttps_epi32(_mm_mul_ps(_clamp(_mm_loadu_ps(source + i + 4)), scale));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_packs_epi32(low, high));
+    }
+    return vectorised;
+  }
+
+  static size_t _convert_sse2(const float* source, int32_t* destination, size_t count) noexcept {
+    const __m128 scale = _mm_set1_ps(_from_float_scale<int32_t>);
+    const size_t vectorised = count - count % 4;
+    for (size_t i = 0; i < vectorised; i += 4) {
+      __m128i samples = _mm_cvttps_epi32(_mm_mul_ps(_clamp(_mm_loadu_ps(source + i)), scale));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), samples);
+    }
+    return vectorised;
+  }
+
+  static size_t _convert_sse2(const int16_t* source, int32_t* destination, size_t count) noexcept {
+    const __m128i zero = _mm_setzero_si128();
+    const size_t vectorised = count - count % 8;
+    for (size_t i = 0; i < vectorised; i += 8) {
+      __m128i samples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_unpacklo_epi16(zero, samples));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i + 4), _mm_unpackhi_epi16(zero, samples));
+    }
+    return vectorised;
+  }
+
+  static size_t _convert_sse2(const int32_t* source, int16_t* destination, size_t count) noexcept {
+    const size_t vectorised = count - count % 8;
+    for (size_t i = 0; i < vectorised; i += 8) {
+      __m128i low = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i)), 16);
+      __m128i high = _mm_srai_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i + 4)), 16);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_packs_epi32(low, high));
+    }
+    return vectorised;
+  }
+#endif
+};
+
+// What a device supports. Probed from a single open of its PCM, then shared
+// read-only by every copy of the device and every getter.
+struct __alsa_device_capabilities {
+  // false when the PCM could not be opened, e.g. because it is busy
+  bool known = false;
+  // the standard rates within the range, ascending
+  vector<unsigned int> sample_rates = {};
+  unsigned int min_sample_rate = 0;
+  unsigned int max_sample_rate = 0;
+  vector<snd_pcm_format_t> audio_formats = {};
+  snd_pcm_uframes_t min_buffer_size = 0;
+  snd_pcm_uframes_t max_buffer_size = 0;
+  // what the driver picks when nothing is constrained
+  snd_pcm_uframes_t default_buffer_size = 0;
+  // for drivers without channel maps, which enumeration asks for
+  unsigned int min_channels = 0;
+  unsigned int max_channels = 0;
+
+  // A PCM that cannot be opened, or answers a query with an error, is
+  // reported as unknown rather than with partial capabilities.
+  static shared_ptr<const __alsa_device_capabilities> probe(const __alsa_audio_device_id& device_id, snd_pcm_stream_t direction) {
+    auto capabilities = make_shared<__alsa_device_capabilities>();
+    auto unknown = [] { return make_shared<const __alsa_device_capabilities>(); };
+
+    __snd_pcm_t_raai pcm = device_id.get_pcm(direction);
+    __snd_pcm_hw_params_raai hw_params = device_id.get_hw_params();
+    if (!pcm || !hw_params)
+      return unknown();
+
+    if (!__alsa_util::check_error(snd_pcm_hw_params_any(pcm.get(), hw_params.get())))
+      return unknown();
+
+    if (!__alsa_util::check_error(snd_pcm_hw_params_get_channels_min(hw_params.get(), &capabilities->min_channels))
+        || !__alsa_util::check_error(snd_pcm_hw_params_get_channels_max(hw_params.get(), &capabilities->max_channels)))
+      return unknown();
+
+    // Only rates inside the range are tested: a continuous range, as
+    // plugins and resampling hardware report, takes them all, and a fixed
+    // rate is listed even when it is not a standard one.
+    if (!__alsa_util::check_error(snd_pcm_hw_params_get_rate_min(hw_params.get(), &capabilities->min_sample_rate, nullptr))
+        || !__alsa_util::check_error(snd_pcm_hw_params_get_rate_max(hw_params.get(), &capabilities->max_sample_rate, nullptr)))
+      return unknown();
+
+    if (capabilities->min_sample_rate == capabilities->max_sample_rate) {
+      capabilities->sample_rates.push_back(capabilities->min_sample_rate);
+    } else {
+      for (auto rate : _standard_sample_rates) {
+        if (rate < capabilities->min_sample_rate || rate > capabilities->max_sample_rate)
+          continue;
+        if (snd_pcm_hw_params_test_rate(pcm.get(), hw_params.get(), rate, 0) == 0)
+          capabilities->sample_rates.push_back(rate);
+      }
+    }
+
+    for (auto format : _test_audio_formats) {
+      if (snd_pcm_hw_params_test_format(pcm.get(), hw_params.get(), format) == 0)
+        capabilities->audio_formats.push_back(format);
+    }
+
+    if (!__alsa_util::check_error(snd_pcm_hw_params_get_buffer_size_min(hw_params.get(), &capabilities->min_buffer_size))
+        || !__alsa_util::check_error(snd_pcm_hw_params_get_buffer_size_max(hw_params.get(), &capabilities->max_buffer_size)))
+      return unknown();
+
+    // installing the unconstrained configuration makes the driver choose
+    if (!__alsa_util::check_error(snd_pcm_hw_params(pcm.get(), hw_params.get()))
+        || !__alsa_util::check_error(snd_pcm_hw_params_get_buffer_size(hw_params.get(), &capabilities->default_buffer_size)))
+      return unknown();
+
+    if (capabilities->min_buffer_size == 0 || capabilities->max_buffer_size < capabilities->min_buffer_size)
+      return unknown();
+
+    capabilities->known = true;
+    return capabilities;
+  }
+
+  // What a device opens at unless told otherwise.
+  unsigned int default_sample_rate() const noexcept {
+    for (auto rate : {44100u, 48000u}) {
+      if (find(begin(sample_rates), end(sample_rates), rate) != end(sample_rates))
+        return rate;
+    }
+    return sample_rates.empty() ? 0 : sample_rates.front();
+  }
+
+private:
+  inline static constexpr auto _standard_sample_rates = __array_of<unsigned int>(
+      4000u,
+      8000u,
+      11025u,
+      16000u,
+      22050u,
+      32000u,
+      44100u,
+      48000u,
+      88200u,
+      96000u,
+      176400u,
+      192000u,
+      352800u,
+      384000u);
+
+  inline static constexpr auto _test_audio_formats = __array_of<snd_pcm_format_t>(
+      SND_PCM_FORMAT_FLOAT_LE,
+      SND_PCM_FORMAT_S16_LE,
+      SND_PCM_FORMAT_S24_LE,
+      SND_PCM_FORMAT_S32_LE,
+      SND_PCM_FORMAT_FLOAT64_LE,
+      SND_PCM_FORMAT_S8
+     );
+};
+
+// Keeps probed capabilities in a file across runs, so that a warm start
+// opens no PCM at all. Entries are keyed by the card's ID, name and driver
+// as its control device reports them now: a replaced or updated card
+// misses and is probed again. Disabled until a file is set.
+class __alsa_capability_cache {
+public:
+  using capabilities_ptr = shared_ptr<const __alsa_device_capabilities>;
+  using entries_t = map<string, capabilities_ptr>;
+
+  static __alsa_capability_cache& get_instance() {
+    static __alsa_capability_cache cache;
+    return cache;
+  }
+
+  void set_file(string path) {
+    lock_guard<mutex> lock(_mutex);
+    _path = move(path);
+    _entries.clear();
+    _loaded = false;
+  }
+
+  // The cached capabilities of the device, or a fresh probe that is then
+  // added to the cache.
+  capabilities_ptr get(const __alsa_audio_device_id& device_id, snd_pcm_stream_t direction) {
+    const optional<string> key = _make_key(device_id, direction);
+    if (!key)
+      return __alsa_device_capabilities::probe(device_id, direction);
+
+    {
+      lock_guard<mutex> lock(_mutex);
+      _load();
+      auto entry = _entries.find(*key);
+      if (entry != _entries.end())
+        return entry->second;
+    }
+
+    auto capabilities = __alsa_device_capabilities::probe(device_id, direction);
+    if (capabilities->known) {
+      lock_guard<mutex> lock(_mutex);
+      _entries[*key] = capabilities;
+      _save();
+    }
+
+    return capabilities;
+  }
+
+  // The file format: a header line, then one line per entry with the key
+  // fields and the capabilities, separated by tabs.
+  static string serialize(const entries_t& entries) {
+    string contents(_header);
+    contents += '\n';
+
+    for (const auto& [key, capabilities] : entries) {
+      contents += key;
+      contents += '\t' + to_string(capabilities->min_buffer_size);
+      contents += '\t' + to_string(capabilities->max_buffer_size);
+      contents += '\t' + to_string(capabilities->default_buffer_size);
+      contents += '\t' + to_string(capabilities->min_sample_rate);
+      contents += '\t' + to_string(capabilities->max_sample_rate);
+      contents += '\t' + to_string(capabilities->min_channels);
+      contents += '\t' + to_string(capabilities->max_channels);
+      contents += '\t';
+      _append_list(contents, capabilities->sample_rates);
+      contents += '\t';
+      _append_list(contents, capabilities->audio_formats);
+      contents += '\n';
+    }
+
+    return contents;
+  }
+
+  // Contents from another version yield no entries; damaged lines are
+  // skipped.
+  static entries_t parse(string_view contents) {
+    entries_t entries;
+    auto lines = _split(contents, '\n');
+    if (lines.empty() || lines[0] != _header)
+      return entries;
+
+    for (size_t i = 1; i < lines.size(); ++i) {
+      auto fields = _split(lines[i], '\t');
+      if (fields.size() != _num_key_fields + 9)
+        continue;
+
+      auto capabilities = make_shared<__alsa_device_capabilities>();
+      auto value = begin(fields) + _num_key_fields;
+      if (!_parse(value[0], capabilities->min_buffer_size)
+          || !_parse(value[1], capabilities->max_buffer_size)
+          || !_parse(value[2], capabilities->default_buffer_size)
+          || !_parse(value[3], capabilities->min_sample_rate)
+          || !_parse(value[4], capabilities->max_sample_rate)
+          || !_parse(value[5], capabilities->min_channels)
+          || !_parse(value[6], capabilities->max_channels)
+          || !_parse_list(value[7], capabilities->sample_rates)
+          || !_parse_list(value[8], capabilities->audio_formats))
+        continue;
+
+      capabilities->known = true;
+      const size_t key_length = value[0].data() - lines[i].data() - 1;
+      entries[string(lines[i].substr(0, key_length))] = move(capabilities);
+    }
+
+    return entries;
+  }
+
+private:
+  __alsa_capability_cache() = default;
+
+  optional<string> _make_key(const __alsa_audio_device_id& device_id, snd_pcm_stream_t direction) {
+    {
+      lock_guard<mutex> lock(_mutex);
+      if (_path.empty())
+        return nullopt;
+    }
+
+    __snd_ctl_t_raai snd_ctl_handle = device_id.card_handle();
+    __snd_ctl_card_info_raai card_info = device_id.get_card_info();
+    if (!snd_ctl_handle || !card_info || snd_ctl_card_info(snd_ctl_handle.get(), card_info.get()) < 0)
+      return nullopt;
+
+    string key;
+    for (const char* field : {snd_ctl_card_info_get_id(card_info.get()),
+                              snd_ctl_card_info_get_name(card_info.get()),
+                              snd_ctl_card_info_get_driver(card_info.get())}) {
+      if (!field || strpbrk(field, "\t\n") != nullptr)
+        return nullopt;
+
+      key += field;
+      key += '\t';
+    }
+
+    key += to_string(device_id.device_id);
+    key += direction == SND_PCM_STREAM_CAPTURE ? "\tcapture" : "\tplayback";
+    return key;
+  }
+
+  // One read of the whole file. A file that is missing, from another
+  // version or damaged is treated as empty and rewritten on the next probe.
+  void _load() {
+    if (_loaded)
+      return;
+
+    _loaded = true;
+
+    int fd = open(_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return;
+
+    string contents;
+    struct stat file_stat = {};
+    if (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) {
+      contents.resize(static_cast<size_t>(file_stat.st_size));
+      if (read(fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()))
+        contents.clear();
+    }
+    close(fd);
+
+    _entries = parse(contents);
+  }
+
+  // Written to a temporary file first, so readers never see half a file.
+  void _save() {
+    const string contents = serialize(_entries);
+
+    const string temporary_path = _path + ".tmp";
+    int fd = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+      return;
+
+    const bool written = write(fd, contents.data(), contents.size()) == static_cast<ssize_t>(contents.size());
+    close(fd);
+
+    if (!written || rename(temporary_path.c_str(), _path.c_str()) != 0)
+      unlink(temporary_path.c_str());
+  }
+
+  static vector<string_view> _split(string_view text, char separator) {
+    vector<string_view> parts;
+    while (!text.empty()) {
+      const size_t end = text.find(separator);
+      parts.push_back(text.substr(0, end));
+      if (end == string_view::npos)
+        break;
+      text.remove_prefix(end + 1);
+    }
+    return parts;
+  }
+
+  template <typename _ValueType>
+  static bool _parse(string_view text, _ValueType& value) {
+    using parsed_t = conditional_t<is_enum_v<_ValueType>, int, _ValueType>;
+    parsed_t parsed = {};
+    auto [end, error] = from_chars(text.data(), text.data() + text.size(), parsed);
+    if (error != errc() || end != text.data() + text.size())
+      return false;
+
+    value = static_cast<_ValueType>(parsed);
+    return true;
+  }
+
+  template <typename _ValueType>
+  static bool _parse_list(string_view text, vector<_ValueType>& values) {
+    for (auto item : _split(text, ',')) {
+      _ValueType value = {};
+      if (!_parse(item, value))
+        return false;
+      values.push_back(value);
+    }
+    return true;
+  }
+
+  template <typename _ValueType>
+  static void _append_list(string& text, const vector<_ValueType>& values) {
+    for (size_t i = 0; i < values.size(); ++i) {
+      if (i > 0)
+        text += ',';
+      text += to_string(static_cast<long long>(values[i]));
+    }
+  }
+
+  inline static constexpr string_view _header = "libstdaudio alsa capabilities 3";
+  // card ID, card name, driver, device number, direction
+  inline static constexpr size_t _num_key_fields = 5;
+
+  mutex _mutex;
+  string _path;
+  bool _loaded = false;
+  entries_t _entries;
+};
+
+// Probes several devices concurrently on a few worker threads. A probe
+// that runs longer than the timeout is abandoned: its device gets unknown
+// capabilities and another worker takes over the remaining devices, so one
+// stalled card delays the result by about one timeout. The abandoned
+// worker discards its result and exits as soon as the driver lets go,
+// without taking another job. Until then it counts against the thread
+// limit, so stalled cards cannot make the pool grow without bound; jobs
+// that find no thread to run on time out in turn.
+//
+// Workers exit once the queue is empty and are joined by the next probe,
+// or when the pool is destroyed at exit, which waits for probes still in
+// the driver. The pool is created after the capability cache the workers
+// write to, so it is destroyed first.
+class __alsa_probe_pool {
+public:
+  using capabilities_ptr = shared_ptr<const __alsa_device_capabilities>;
+  using job_t = pair<__alsa_audio_device_id, snd_pcm_stream_t>;
+
+  static __alsa_probe_pool& get_instance() {
+    static __alsa_probe_pool pool;
+    return pool;
+  }
+
+  ~__alsa_probe_pool() {
+    unique_lock<mutex> lock(_mutex);
+    _stopping = true;
+    list<thread> workers = move(_workers);
+    lock.unlock();
+
+    for (thread& worker : workers)
+      worker.join();
+  }
+
+  vector<capabilities_ptr> probe(vector<job_t> jobs, chrono::milliseconds timeout) {
+    auto batch = make_shared<__batch>();
+    batch->jobs = move(jobs);
+    batch->results.resize(batch->jobs.size());
+    batch->started.resize(batch->jobs.size());
+    batch->last_progress = chrono::steady_clock::now();
+
+    unique_lock<mutex> lock(_mutex);
+    _batches.push_back(batch);
+
+    while (true) {
+      _join_exited_workers(lock);
+      _spawn_workers();
+
+      const auto now = chrono::steady_clock::now();
+      auto next_deadline = chrono::steady_clock::time_point::max();
+      bool pending = false;
+
+      for (size_t i = 0; i < batch->jobs.size(); ++i) {
+        if (batch->results[i])
+          continue;
+
+        // a job still queued waits for as long as the batch makes no progress
+        const bool started = batch->started[i] != chrono::steady_clock::time_point();
+        const auto deadline = (started ? batch->started[i] : batch->last_progress) + timeout;
+        if (now >= deadline) {
+          batch->results[i] = make_shared<__alsa_device_capabilities>();
+          // its worker no longer counts towards the ones taking jobs
+          if (started)
+            --_active_workers;
+        } else {
+          pending = true;
+          next_deadline = min(next_deadline, deadline);
+        }
+      }
+
+      if (!pending)
+        break;
+
+      _progress.wait_until(lock, next_deadline);
+    }
+
+    _batches.erase(find(_batches.begin(), _batches.end(), batch));
+    return batch->results;
+  }
+
+  // Waits until no probe has the device open, e.g. for an abandoned probe
+  // that made opening the device fail with EBUSY. False if none had it
+  // open, or it still does after the timeout.
+  bool wait_for_release(const string& device_id_str, chrono::milliseconds timeout) {
+    unique_lock<mutex> lock(_mutex);
+    auto probing = [this, &device_id_str] {
+      return find(_probing.begin(), _probing.end(), device_id_str) != _probing.end();
+    };
+
+    if (!probing())
+      return false;
+
+    return _released.wait_for(lock, timeout, [&probing] { return !probing(); });
+  }
+
+private:
+  struct __batch {
+    vector<job_t> jobs;
+    vector<capabilities_ptr> results;
+    vector<chrono::steady_clock::time_point> started;
+    chrono::steady_clock::time_point last_progress;
+    size_t next_job = 0;
+  };
+
+  __alsa_probe_pool() {
+    __alsa_capability_cache::get_instance();
+  }
+
+  // Enough workers to take the queued jobs, up to _max_workers taking jobs
+  // and _max_threads alive.
+  void _spawn_workers() {
+    size_t queued = 0;
+    for (const auto& batch : _batches) {
+      for (size_t i = batch->next_job; i < batch->jobs.size(); ++i)
+        queued += batch->results[i] ? 0 : 1;
+    }
+
+    while (_active_workers < min(queued, _max_workers) && _workers.size() < _max_threads) {
+      _workers.emplace_back(&__alsa_probe_pool::_run_worker, this);
+      ++_active_workers;
+    }
+  }
+
+  void _join_exited_workers(unique_lock<mutex>& lock) {
+    list<thread> exited;
+    for (thread::id id : exchange(_exited_workers, {})) {
+      auto worker = find_if(_workers.begin(), _workers.end(), [id](const thread& t) { return t.get_id() == id; });
+      exited.splice(exited.end(), _workers, worker);
+    }
+
+    lock.unlock();
+    for (thread& worker : exited)
+      worker.join();
+    lock.lock();
+  }
+
+  void _run_worker() {
+    unique_lock<mutex> lock(_mutex);
+    bool abandoned = false;
+
+    while (!_stopping && !abandoned) {
+      auto [batch, job] = _next_job();
+      if (!batch)
+        break;
+
+      batch->started[job] = batch->last_progress = chrono::steady_clock::now();
+      const auto [device_id, direction] = batch->jobs[job];
+      const string device_id_str = device_id.get_device_id_str();
+      _probing.push_back(device_id_str);
+
+      lock.unlock();
+      auto capabilities = __alsa_capability_cache::get_instance().get(device_id, direction);
+      lock.lock();
+
+      _probing.erase(find(_probing.begin(), _probing.end(), device_id_str));
+      _released.notify_all();
+
+      // a timed out job already has unknown capabilities
+      abandoned = batch->results[job] != nullptr;
+      if (!abandoned) {
+        batch->results[job] = move(capabilities);
+        batch->last_progress = chrono::steady_clock::now();
+      }
+      _progress.notify_all();
+    }
+
+    if (!abandoned)
+      --_active_workers;
+    _exited_workers.push_back(this_thread::get_id());
+  }
+
+  pair<shared_ptr<__batch>, size_t> _next_job() {
+    for (const auto& batch : _batches) {
+      while (batch->next_job < batch->jobs.size()) {
+        const size_t job = batch->next_job++;
+        if (!batch->results[job])
+          return {batch, job};
+      }
+    }
+    return {nullptr, 0};
+  }
+
+  // probing mostly waits on the driver, not the CPU
+  inline static constexpr size_t _max_workers = 4;
+  // including abandoned workers still stuck in a driver
+  inline static constexpr size_t _max_threads = 8;
+
+  mutex _mutex;
+  condition_variable _progress;
+  condition_variable _released;
+  vector<shared_ptr<__batch>> _batches;
+  list<thread> _workers;
+  vector<thread::id> _exited_workers;
+  // device ID strings of the PCMs workers have open
+  vector<string> _probing;
+  size_t _active_workers = 0;
+  bool _stopping = false;
+};
+
+// How the processing thread knows when to run the callback. With interrupt
+// scheduling it sleeps in poll() until the driver signals a period. With
+// timer scheduling period interrupts are disabled where the driver allows
+// it, and the thread sleeps on a high resolution timer until the rings
+// are about to run out, as PulseAudio's tsched does. That wakes less often
+// for large buffers, and at finer granularity than a period for small ones.
+// With spin scheduling the thread never sleeps while a period is due: it
+// watches the hardware pointer in the status page the kernel maps, and only
+// falls back to poll() once the spin budget of a wait is spent. That is for
+// a thread pinned to an isolated CPU, which it keeps busy.
+enum class audio_device_scheduling {
+  interrupt,
+  timer,
+  spin
+};
+
+// Decides how long the processing thread sleeps under timer scheduling.
+// The headroom is how many frames the emptiest playback or fullest capture
+// ring can still absorb; the thread wakes a watermark before it is used up.
+// The watermark starts at a quarter of the buffer, doubles (up to half the
+// buffer) on every xrun and shrinks by an eighth after every ten seconds
+// without one, down to a sixteenth.
+class __alsa_timer_scheduler {
+public:
+  void reset(snd_pcm_uframes_t buffer_size) noexcept {
+    _min_watermark = max<snd_pcm_uframes_t>(1, buffer_size / 16);
+    _max_watermark = max(_min_watermark, buffer_size / 2);
+    _watermark = clamp(buffer_size / 4, _min_watermark, _max_watermark);
+    _last_adjustment = audio_clock_t::now();
+  }
+
+  void record_xrun() noexcept {
+    _watermark = min(_watermark * 2, _max_watermark);
+    _last_adjustment = audio_clock_t::now();
+  }
+
+  chrono::nanoseconds sleep_time(snd_pcm_uframes_t headroom, unsigned int sample_rate) noexcept {
+    return sleep_time(headroom, sample_rate, audio_clock_t::now());
+  }
+
+  chrono::nanoseconds sleep_time(snd_pcm_uframes_t headroom, unsigned int sample_rate,
+                                 chrono::time_point<audio_clock_t> now) noexcept {
+    if (now - _last_adjustment >= _decrease_interval) {
+      _watermark = max(_watermark - _watermark / 8, _min_watermark);
+      _last_adjustment = now;
+    }
+
+    if (headroom <= _watermark || sample_rate == 0)
+      return _min_sleep_time;
+
+    const auto sleep_time = chrono::nanoseconds((headroom - _watermark) * 1'000'000'000 / sample_rate);
+    return max<chrono::nanoseconds>(sleep_time, _min_sleep_time);
+  }
+
+  snd_pcm_uframes_t watermark() const noexcept {
+    return _watermark;
+  }
+
+private:
+  inline static constexpr auto _decrease_interval = chrono::seconds(10);
+  inline static constexpr auto _min_sleep_time = chrono::microseconds(100);
+
+  snd_pcm_uframes_t _watermark = 0;
+  snd_pcm_uframes_t _min_watermark = 0;
+  snd_pcm_uframes_t _max_watermark = 0;
+  chrono::time_point<audio_clock_t> _last_adjustment = {};
+};
+
+// How a device gets going once started. Playback is primed with
+// prefill_periods periods, rendered by the callback (silence in duplex
+// mode and in an engine) before the stream starts; the rest of the ring is
+// filled once it runs. The default primes the whole buffer. Fewer periods
+// get the first sound out sooner, leaving less room for the first wakeups
+// to be late; at least one is always written, as ALSA does not start
+// playback on an empty ring.
+//
+// With start_immediately the stream is primed and started on the thread
+// calling start(), which then returns with the hardware running. Otherwise
+// the processing thread does both once it has been scheduled.
+struct audio_device_start_policy {
+  unsigned int prefill_periods = numeric_limits<unsigned int>::max();
+  bool start_immediately = false;
+};
+
+// Which PCMs audio_device::start opens. In duplex mode capture and playback
+// are linked and serviced by the same callback.
+enum class audio_device_io_mode {
+  output,
+  input,
+  duplex
+};
+
+// What pause() does with a stream.
+enum class __alsa_pause_action {
+  none,
+  pause,
+  drop
+};
+
+// One direction of an opened device.
+struct __alsa_pcm_stream {
+  snd_pcm_stream_t direction = SND_PCM_STREAM_PLAYBACK;
+  int num_channels = 0;
+  snd_pcm_access_t access_type {};
+  snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+  __snd_pcm_t_raai pcm;
+  __snd_pcm_hw_params_raai hw_params;
+
+  // Interleaved frames of the callback's sample type, used when the ring
+  // cannot be handed out directly: the format needs converting, or a fixed
+  // block straddles the end of the ring.
+  vector<char> staging_buffer = {};
+
+  // Frames in the device format, for PCMs without mmap access that need
+  // converting on their way through snd_pcm_readi or snd_pcm_writei.
+  vector<char> rw_buffer = {};
+
+  // Reference point of the callback timestamps, refreshed on every wakeup:
+  // the ring held timestamp_avail frames at timestamp, and frames_processed
+  // frames have been handed to the callback since.
+  bool hardware_timestamps = false;
+  chrono::time_point<audio_clock_t> timestamp = {};
+  snd_pcm_uframes_t timestamp_avail = 0;
+  snd_pcm_uframes_t frames_processed = 0;
+
+  // Frames moved through the ring since the stream was last prepared.
+  uint64_t frames_transferred = 0;
+
+  // Frames moved through the ring since the device started, less those
+  // rewound: unlike frames_transferred it carries on across xruns.
+  uint64_t position = 0;
+
+  // What the hardware granted when the stream was last opened.
+  snd_pcm_uframes_t buffer_size = 0;
+  snd_pcm_uframes_t period_size = 0;
+  unsigned int period_count = 0;
+  bool can_pause = false;
+
+  template <typename _SampleType>
+  bool is_native() const noexcept {
+    return format == __alsa_native_format<_SampleType>;
+  }
+
+  template <typename _SampleType>
+  _SampleType* staging_data(snd_pcm_uframes_t frame = 0) noexcept {
+    return reinterpret_cast<_SampleType*>(staging_buffer.data()) + frame * num_channels;
+  }
+
+  snd_pcm_t* get() const noexcept {
+    return pcm.get();
+  }
+
+  bool is_open() const noexcept {
+    return pcm != nullptr;
+  }
+
+  bool is_capture() const noexcept {
+    return direction == SND_PCM_STREAM_CAPTURE;
+  }
+
+  bool is_mmap() const noexcept {
+    return access_type != SND_PCM_ACCESS_RW_INTERLEAVED;
+  }
+
+  // A running stream that can pause keeps its queued frames; one that
+  // cannot is dropped, and primed again on resume. A stream that is not
+  // running yet keeps what it was primed with.
+  __alsa_pause_action pause_action(snd_pcm_state_t state) const noexcept {
+    if (state != SND_PCM_STATE_RUNNING)
+      return __alsa_pause_action::none;
+
+    return can_pause ? __alsa_pause_action::pause : __alsa_pause_action::drop;
+  }
+
+  // Playback frames still queued when avail frames of the ring are free.
+  snd_pcm_uframes_t queued_frames(snd_pcm_uframes_t avail) const noexcept {
+    return buffer_size - min(avail, buffer_size);
+  }
+
+  // Playback frames primed before the stream starts: whole periods, and
+  // whole blocks in fixed-block mode, within the buffer.
+  snd_pcm_uframes_t prefill_frames(unsigned int prefill_periods, snd_pcm_uframes_t block_size) const noexcept {
+    const unsigned int periods = max(prefill_periods, 1u);
+    snd_pcm_uframes_t frames = periods >= period_count ? buffer_size : periods * period_size;
+    if (block_size > 0)
+      frames = (frames + block_size - 1) / block_size * block_size;
+    return min(frames, buffer_size);
+  }
+
+  // Once the hardware pointer has moved, the reference timestamp dates the
+  // first frame, however late the thread woke up: playback has consumed
+  // what was written minus what is still queued, capture has produced what
+  // was read plus what is available. Nothing until then.
+  optional<chrono::time_point<audio_clock_t>> first_frame_time(unsigned int sample_rate) const noexcept {
+    if (sample_rate == 0)
+      return nullopt;
+
+    const auto transferred = static_cast<snd_pcm_sframes_t>(frames_transferred);
+    const auto avail = static_cast<snd_pcm_sframes_t>(timestamp_avail);
+    const snd_pcm_sframes_t moved = is_capture()
+      ? transferred + avail
+      : transferred - (static_cast<snd_pcm_sframes_t>(buffer_size) - avail);
+    if (moved <= 0)
+      return nullopt;
+
+    return timestamp - chrono::duration_cast<audio_clock_t::duration>(
+      chrono::nanoseconds(moved * 1'000'000'000 / static_cast<snd_pcm_sframes_t>(sample_rate)));
+  }
+
+  // Playback frames to rewind towards position requested: as many as the
+  // hardware has not played yet, less the margin, in whole blocks.
+  snd_pcm_uframes_t rewind_frames(uint64_t requested, snd_pcm_sframes_t rewindable,
+                                  snd_pcm_sframes_t margin_frames, snd_pcm_uframes_t block_size) const noexcept {
+    if (requested >= position)
+      return 0;
+
+    const auto allowed = static_cast<uint64_t>(max<snd_pcm_sframes_t>(rewindable - margin_frames, 0));
+    auto frames = static_cast<snd_pcm_uframes_t>(min(position - requested, allowed));
+    if (block_size > 0)
+      frames -= frames % block_size;
+    return frames;
+  }
+
+  void close() noexcept {
+    pcm.reset();
+    hw_params.reset();
+  }
+};
+
+// The position rewind_output() asked for, set from any thread and taken by
+// the processing thread. Requests it has not taken yet combine to the
+// earliest position.
+class __alsa_rewind_request {
+public:
+  __alsa_rewind_request() = default;
+
+  __alsa_rewind_request(__alsa_rewind_request&& other) noexcept
+    : _position(other._position.exchange(_none, memory_order_relaxed)) {
+  }
+
+  __alsa_rewind_request& operator=(__alsa_rewind_request&& other) noexcept {
+    if (this != &other)
+      _position.store(other._position.exchange(_none, memory_order_relaxed), memory_order_relaxed);
+    return *this;
+  }
+
+  void request(uint64_t position) noexcept {
+    uint64_t requested = _position.load(memory_order_relaxed);
+    while (position < requested
+           && !_position.compare_exchange_weak(requested, position, memory_order_release, memory_order_relaxed)) {
+    }
+  }
+
+  bool is_pending() const noexcept {
+    return _position.load(memory_order_relaxed) != _none;
+  }
+
+  optional<uint64_t> take() noexcept {
+    if (!is_pending())
+      return nullopt;
+
+    const uint64_t position = _position.exchange(_none, memory_order_acquire);
+    if (position == _none)
+      return nullopt;
+    return position;
+  }
+
+  void clear() noexcept {
+    _position.store(_none, memory_order_relaxed);
+  }
+
+private:
+  inline static constexpr uint64_t _none = numeric_limits<uint64_t>::max();
+
+  atomic<uint64_t> _position = _none;
+};
+
+// The device settings a pair of PCMs was configured with. PCMs configured
+// with the settings in force are started again without being reconfigured.
+struct __alsa_stream_settings {
+  audio_device_io_mode io_mode = audio_device_io_mode::output;
+  snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+  unsigned int sample_rate = 0;
+  int num_input_channels = 0;
+  int num_output_channels = 0;
+  snd_pcm_uframes_t buffer_size = 0;
+  snd_pcm_uframes_t block_size = 0;
+  chrono::microseconds target_latency = {};
+  unsigned int period_count = 0;
+  audio_device_scheduling scheduling = audio_device_scheduling::interrupt;
+  unsigned int prefill_periods = 0;
+
+  auto tie() const noexcept {
+    return std::tie(io_mode, format, sample_rate, num_input_channels, num_output_channels, buffer_size,
+                    block_size, target_latency, period_count, scheduling, prefill_periods);
+  }
+
+  bool operator==(const __alsa_stream_settings& other) const noexcept {
+    return tie() == other.tie();
+  }
+
+  bool operator!=(const __alsa_stream_settings& other) const noexcept {
+    return !(*this == other);
+  }
+};
+
+// A region of a stream's ring handed out by snd_pcm_mmap_begin.
+struct __alsa_mmap_region {
+  const snd_pcm_channel_area_t* areas = nullptr;
+  snd_pcm_uframes_t offset = 0;
+  snd_pcm_uframes_t frames = 0;
+};
+
+// The regions one callback works on, and whether each is handed to the
+// callback in place or through the stream's staging buffer.
+struct __alsa_io_regions {
+  __alsa_mmap_region input;
+  __alsa_mmap_region output;
+  bool input_direct = false;
+  bool output_direct = false;
+};
+
+enum class __alsa_run_state {
+  running,
+  pending,
+  failed
+};
+
+class audio_device {
+public:
+  audio_device() = delete;
+  audio_device(const audio_device&) = delete;
+  audio_device& operator=(const audio_device&) = delete;
+  audio_device(audio_device&& other)
+      : _sample_rate(other._sample_rate)
+      , _audio_format(other._audio_format)
+      , _buffer_size_frames(other._buffer_size_frames)
+      , _block_size_frames(other._block_size_frames)
+      , _target_latency(other._target_latency)
+      , _period_count(other._period_count)
+      , _wake_event(move(other._wake_event))
+      , _poll_fd(move(other._poll_fd))
+      , _capabilities(move(other._capabilities))
+      , _device_id(other._device_id)
+      , _io_mode(other._io_mode)
+      , _input_stream(move(other._input_stream))
+      , _output_stream(move(other._output_stream))
+      , _streams_linked(other._streams_linked)
+      , _configured_settings(other._configured_settings)
+      , _paused(exchange(other._paused, false))
+      , _engine_owned(exchange(other._engine_owned, false))
+      , _processing_thread(move(other._processing_thread))
+      , _running(other._running.exchange(false))
+      , _thread_policy(move(other._thread_policy))
+      , _thread_policy_status(other._thread_policy_status)
+      , _scheduling(other._scheduling)
+      , _timer_scheduler(other._timer_scheduler)
+      , _start_policy(other._start_policy)
+      , _spin_budget(other._spin_budget)
+      , _rewind_margin(other._rewind_margin)
+      , _rewind_request(move(other._rewind_request))
+      , _output_position(other._output_position.exchange(0))
+      , _start_time(exchange(other._start_time, {}))
+      , _first_frame_pending(exchange(other._first_frame_pending, false))
+      , _streams_running(exchange(other._streams_running, false))
+      , _event_reporter(move(other._event_reporter))
+      , _stats(move(other._stats))
+      , _name(move(other._name))
+      , _config(other._config)
+      , _num_channels(other._num_channels)
+      , _user_callback(move(other._user_callback))
+  {
+    // the engine holds on to the device it was given
+    assert(!_engine_owned);
+  }
+
+  audio_device& operator=(audio_device&& other) noexcept {
+    assert(!_engine_owned && !other._engine_owned);
+    stop();
+
+    _sample_rate = other._sample_rate;
+    _audio_format = other._audio_format;
+    _buffer_size_frames = other._buffer_size_frames;
+    _block_size_frames = other._block_size_frames;
+    _target_latency = other._target_latency;
+    _period_count = other._period_count;
+    _wake_event = move(other._wake_event);
+    _poll_fd = move(other._poll_fd);
+    _capabilities = move(other._capabilities);
+    _device_id = other._device_id;
+    _io_mode = other._io_mode;
+    _input_stream = move(other._input_stream);
+    _output_stream = move(other._output_stream);
+    _streams_linked = other._streams_linked;
+    _configured_settings = other._configured_settings;
+    _paused = exchange(other._paused, false);
+    _engine_owned = exchange(other._engine_owned, false);
+    _processing_thread = move(other._processing_thread);
+    _running = other._running.exchange(false);
+    _thread_policy = move(other._thread_policy);
+    _thread_policy_status = other._thread_policy_status;
+    _scheduling = other._scheduling;
+    _timer_scheduler = other._timer_scheduler;
+    _start_policy = other._start_policy;
+    _spin_budget = other._spin_budget;
+    _rewind_margin = other._rewind_margin;
+    _rewind_request = move(other._rewind_request);
+    _output_position = other._output_position.exchange(0);
+    _start_time = exchange(other._start_time, {});
+    _first_frame_pending = exchange(other._first_frame_pending, false);
+    _streams_running = exchange(other._streams_running, false);
+    _event_reporter = move(other._event_reporter);
+    _stats = move(other._stats);
+    _name = move(other._name);
+    _config = other._config;
+    _num_channels = other._num_channels;
+    _user_callback = move(other._user_callback);
+    return *this;
+  }
+
+  ~audio_device() {
+    stop();
+  }
+
+  string_view name() const noexcept {
+    return _name;
+  }
+
+  using device_id_t = __alsa_audio_device_id;
+
+  device_id_t device_id() const noexcept {
+    return _device_id;
+  }
+
+  bool is_input() const noexcept {
+    return get_num_input_channels() > 0;
+  }
+
+  bool is_output() const noexcept {
+    return get_num_output_channels() > 0;
+  }
+
+  int get_num_input_channels() const noexcept {
+    return _num_channels.input_config;
+  }
+
+  int get_num_output_channels() const noexcept {
+    return _num_channels.output_config;
+  }
+
+  // The widest channel map the device offers, and the most the callback
+  // can be handed. Devices open with all of them unless fewer are set.
+  int get_max_num_input_channels() const noexcept {
+    return _config.input_config;
+  }
+
+  int get_max_num_output_channels() const noexcept {
+    return _config.output_config;
+  }
+
+  bool set_num_input_channels(int num_channels) {
+    return _set_num_channels(_num_channels.input_config, _config.input_config, num_channels);
+  }
+
+  bool set_num_output_channels(int num_channels) {
+    return _set_num_channels(_num_channels.output_config, _config.output_config, num_channels);
+  }
+
+  // False when the device could not be probed, e.g. because it was busy or
+  // took too long to answer during enumeration. Its supported rates and
+  // formats are then empty.
+  bool has_known_capabilities() const noexcept {
+    return _capabilities->known;
+  }
+
+  // Devices from the input list default to input, all others to output.
+  // Duplex needs both capture and playback channels.
+  bool set_io_mode(audio_device_io_mode mode) {
+    if (_is_busy())
+      return false;
+
+    if (!_supports_io_mode(mode))
+      return false;
+
+    _io_mode = mode;
+    return true;
+  }
+
+  audio_device_io_mode get_io_mode() const noexcept {
+    return _io_mode;
+  }
+
+  using sample_rate_t = unsigned int;
+
+  sample_rate_t get_sample_rate() const noexcept {
+    return _sample_rate;
+  }
+
+  // A stopped device opens at the new rate when it starts. A running one is
+  // switched over: the processing thread stops, the PCMs are reconfigured
+  // without being closed and the thread restarts, dropping what was queued.
+  // The event callback then receives a sample_rate_changed event. A rate the
+  // hardware refuses leaves a running device at its old rate. Devices an
+  // audio_device_engine drives keep their rate until the engine stops.
+  bool set_sample_rate(sample_rate_t new_sample_rate) {
+    if (new_sample_rate == 0 || _engine_owned)
+      return false;
+
+    if (_capabilities->known
+        && (new_sample_rate < _capabilities->min_sample_rate || new_sample_rate > _capabilities->max_sample_rate))
+      return false;
+
+    if (new_sample_rate == _sample_rate)
+      return true;
+
+    if (!_running) {
+      _sample_rate = new_sample_rate;
+      return true;
+    }
+
+    return _switch_sample_rate(new_sample_rate);
+  }
+
+  // The range the device reports. Hardware without a resampler may take
+  // only some of the rates inside it; get_supported_sample_rates lists the
+  // standard ones it does take.
+  sample_rate_t get_min_sample_rate() const noexcept {
+    return _capabilities->min_sample_rate;
+  }
+
+  sample_rate_t get_max_sample_rate() const noexcept {
+    return _capabilities->max_sample_rate;
+  }
+
+  using buffer_size_t = snd_pcm_uframes_t;
+  snd_pcm_format_t get_audio_format() const noexcept {
+    return _audio_format;
+  }
+
+  // What the hardware granted while the PCMs are configured with the
+  // current settings, the size asked for otherwise.
+  buffer_size_t get_buffer_size_frames() const noexcept {
+    if (_configured_settings && *_configured_settings == _stream_settings(_configured_settings->scheduling))
+      return _primary_stream().buffer_size;
+
+    return _buffer_size_frames;
+  }
+
+  // Empty when the device could not be probed.
+  const vector<sample_rate_t>& get_supported_sample_rates() const noexcept {
+    return _capabilities->sample_rates;
+  }
+
+  const vector<snd_pcm_format_t>& get_supported_audio_formats() const noexcept {
+    return _capabilities->audio_formats;
+  }
+
+  bool set_buffer_size_frames(buffer_size_t new_buffer_size) {
+
+    if (_is_busy())
+      return false;
+
+    if (new_buffer_size < _capabilities->min_buffer_size || new_buffer_size > _capabilities->max_buffer_size)
+      return false;
+
+    // applied, and rounded to what the hardware accepts, by start()
+    _buffer_size_frames = new_buffer_size;
+    _target_latency = {};
+    return true;
+  }
+
+  // When non-zero the callback is always handed exactly this many frames, and
+  // the period size is requested to match. Zero (the default) hands over
+  // whatever the device has available.
+  bool set_block_size_frames(buffer_size_t block_size) {
+    if (_is_busy())
+      return false;
+
+    if (block_size > _capabilities->max_buffer_size)
+      return false;
+
+    _block_size_frames = block_size;
+    return true;
+  }
+
+  buffer_size_t get_block_size_frames() const noexcept {
+    return _block_size_frames;
+  }
+
+  bool set_scheduling(audio_device_scheduling scheduling) {
+    if (_is_busy())
+      return false;
+
+    _scheduling = scheduling;
+    return true;
+  }
+
+  audio_device_scheduling get_scheduling() const noexcept {
+    return _scheduling;
+  }
+
+  // How long spin scheduling spins for each period before it blocks in
+  // poll(). A budget of a whole period never blocks while the device runs.
+  bool set_spin_budget(chrono::microseconds budget) {
+    if (_is_busy() || budget.count() < 0)
+      return false;
+
+    _spin_budget = budget;
+    return true;
+  }
+
+  chrono::microseconds get_spin_budget() const noexcept {
+    return _spin_budget;
+  }
+
+  bool set_start_policy(const audio_device_start_policy& policy) {
+    if (_is_busy())
+      return false;
+
+    _start_policy = policy;
+    return true;
+  }
+
+  audio_device_start_policy get_start_policy() const noexcept {
+    return _start_policy;
+  }
+
+  // Asks for this much buffering, split into period_count periods with one
+  // wakeup per period: fewer periods wake less often, more periods leave
+  // more room for a late wakeup. Zero periods leaves the split to the
+  // driver. The latency is converted to frames at the sample rate in use
+  // when the device starts; a block size, if set, is the period size.
+  bool set_target_latency(chrono::microseconds latency, unsigned int period_count = 0) {
+    if (_is_busy() || latency.count() <= 0 || period_count == 1)
+      return false;
+
+    _target_latency = latency;
+    _period_count = period_count;
+    return true;
+  }
+
+  bool set_target_latency_frames(buffer_size_t frames, unsigned int period_count = 0) {
+    if (period_count == 1 || !set_buffer_size_frames(frames))
+      return false;
+
+    _period_count = period_count;
+    return true;
+  }
+
+  // What the hardware granted, once started. Output latency is the whole
+  // buffer, which the callback keeps filled. Input latency is one period,
+  // which has to be complete before the callback sees it.
+  chrono::microseconds get_output_latency() const noexcept {
+    return _frames_to_time(_output_stream.buffer_size);
+  }
+
+  chrono::microseconds get_input_latency() const noexcept {
+    return _frames_to_time(_input_stream.period_size);
+  }
+
+  buffer_size_t get_period_size_frames() const noexcept {
+    return _primary_stream().period_size;
+  }
+
+  unsigned int get_period_count() const noexcept {
+    return _primary_stream().period_count;
+  }
+
+  template <typename _SampleType>
+  constexpr bool supports_sample_type() const noexcept {
+    return
+      is_same_v<_SampleType, float>
+      || is_same_v<_SampleType, int32_t>
+      || is_same_v<_SampleType, int16_t>;
+  }
+
+  // Opens the device in the PCM format that carries _SampleType as is.
+  // Returns false if the hardware does not offer it; the device then runs in
+  // the closest format the backend converts from.
+  template <typename _SampleType>
+  bool set_sample_type() {
+    if (_is_busy())
+      return false;
+
+    if (_is_connected() && !holds_alternative<__alsa_callback_t<_SampleType>>(_user_callback))
+      throw audio_device_exception("cannot change sample type after connecting a callback");
+
+    return _set_sample_type_helper<_SampleType>();
+  }
+
+  // True when _SampleType reaches the hardware without conversion.
+  template <typename _SampleType>
+  bool is_sample_type() const noexcept {
+    return _audio_format == __alsa_native_format<_SampleType>;
+  }
+
+  constexpr bool can_connect() const noexcept {
+    return true;
+  }
+
+  constexpr bool can_process() const noexcept {
+    return false;
+  }
+
+  template <typename _CallbackType,
+            enable_if_t<is_nothrow_invocable_v<_CallbackType, audio_device&, audio_device_io<float>&>, int> = 0>
+  void connect(_CallbackType callback) {
+    _connect_helper<float>(move(callback));
+  }
+
+  template <typename _CallbackType,
+            enable_if_t<is_nothrow_invocable_v<_CallbackType, audio_device&, audio_device_io<int32_t>&>, int> = 0>
+  void connect(_CallbackType callback) {
+    _connect_helper<int32_t>(move(callback));
+  }
+
+  template <typename _CallbackType,
+            enable_if_t<is_nothrow_invocable_v<_CallbackType, audio_device&, audio_device_io<int16_t>&>, int> = 0>
+  void connect(_CallbackType callback) {
+    _connect_helper<int16_t>(move(callback));
+  }
+
+  // Receives the diagnostics raised by the processing thread. The sink runs on
+  // a separate reporting thread, never on the audio thread.
+  template <typename _EventCallbackType,
+            typename = enable_if_t<is_invocable_v<_EventCallbackType, const audio_device_event&>>>
+  void set_event_callback(_EventCallbackType callback) {
+    if (_is_busy())
+      throw audio_device_exception("cannot set the event callback of a running audio_device");
+
+    _event_reporter = make_unique<__alsa_event_reporter>(move(callback));
+  }
+
+  size_t get_dropped_event_count() const noexcept {
+    return _event_reporter->dropped_events();
+  }
+
+  // Lock-free: safe to poll from any thread while the device runs.
+  audio_device_stats get_stats() const noexcept {
+    return _stats->snapshot();
+  }
+
+  void reset_stats() noexcept {
+    if (_running)
+      _stats->request_reset();
+    else
+      _stats->reset();
+  }
+
+  // TODO: remove std::function as soon as C++20 default-ctable lambda and lambda in unevaluated contexts become available
+  using no_op_t = std::function<void(audio_device&)>;
+
+  template <typename _StartCallbackType = no_op_t,
+            typename _StopCallbackType = no_op_t,
+            // TODO: is_nothrow_invocable_t does not compile, temporarily replaced with is_invocable_t
+            typename = enable_if_t<is_invocable_v<_StartCallbackType, audio_device&> && is_invocable_v<_StopCallbackType, audio_device&>>>
+  bool start(_StartCallbackType&& start_callback = [](audio_device&) noexcept {},
+             _StopCallbackType&& stop_callback = [](audio_device&) noexcept {}) {
+    if (_engine_owned)
+      return false;
+
+    if (!_running) {
+      // a processing thread that stopped on an error is cleaned up first
+      if (_processing_thread.joinable())
+        stop();
+
+      const bool resuming = exchange(_paused, false);
+      if (!resuming) {
+        _arm_first_frame();
+        _reset_positions();
+      }
+
+      if (!_streams_reusable(_scheduling)) {
+        if (!_open_streams(_scheduling))
+          return false;
+      } else if (resuming) {
+        _release_pause();
+      }
+
+      _timer_scheduler.reset(_primary_stream().buffer_size);
+
+      // No processing thread exists yet, so the caller's thread has the
+      // streams, the stats and the event ring to itself.
+      if (_start_policy.start_immediately && !_prime_and_start())
+        return false;
+
+      if (!_start_processing())
+        return false;
+    }
+
+    return true;
+  }
+
+  template <typename _StartCallbackType = no_op_t,
+            typename _StopCallbackType = no_op_t,
+            typename = enable_if_t<is_invocable_v<_StartCallbackType, audio_device&> && is_invocable_v<_StopCallbackType, audio_device&>>>
+  bool start(const audio_thread_policy& policy,
+             _StartCallbackType&& start_callback = [](audio_device&) noexcept {},
+             _StopCallbackType&& stop_callback = [](audio_device&) noexcept {}) {
+    if (!_running)
+      _thread_policy = policy;
+
+    return start(forward<_StartCallbackType>(start_callback), forward<_StopCallbackType>(stop_callback));
+  }
+
+  audio_thread_policy_status get_thread_policy_status() const noexcept {
+    return _thread_policy_status;
+  }
+
+  // Returns within one callback: the processing thread is woken out of
+  // poll() rather than left to notice on the next period. The PCMs stay
+  // open and configured, so a start() with unchanged settings skips the
+  // hw_params negotiation. Devices an audio_device_engine drives are
+  // stopped through the engine.
+  bool stop() {
+    if (_engine_owned)
+      return false;
+
+    if (_running || _paused || _processing_thread.joinable()) {
+      if (_paused)
+        _drop_streams();
+      else
+        _stop_processing();
+      _paused = false;
+      // moved-from devices have no reporter
+      if (_event_reporter)
+        _event_reporter->stop();
+    }
+
+    return true;
+  }
+
+  // Stops the processing thread and holds the PCMs with snd_pcm_pause,
+  // keeping the frames queued for playback. PCMs that cannot pause are
+  // dropped instead, and are primed again on resume. Settings can be
+  // changed while paused; resume() then applies them as start() does.
+  bool pause() {
+    if (_paused)
+      return true;
+
+    if (!_running || _engine_owned)
+      return false;
+
+    _join_processing_thread();
+    _pause_streams();
+    _paused = true;
+    return true;
+  }
+
+  // Carries on from where pause() left off: the PCMs are released and the
+  // processing thread restarted, without reconfiguring them.
+  bool resume() {
+    if (_engine_owned)
+      return false;
+
+    if (!_paused)
+      return _running;
+
+    return start();
+  }
+
+  bool is_paused() const noexcept {
+    return _paused;
+  }
+
+  // Replaces queued output. With a deep buffer (a large target latency and
+  // timer scheduling) the callback runs rarely and what it renders is heard
+  // a buffer later. rewind_output moves the playback ring back to
+  // frame_position, as far as the frames the hardware has not played yet
+  // allow, and has the processing thread call the callback again from
+  // there straight away. A callback that renders from
+  // get_output_frame_position() thereby replaces the queued audio with its
+  // current state. Requests the thread has not got to yet combine to the
+  // earliest position; audio_device_stats counts the rewinds carried out.
+  //
+  // Only for output devices started on their own: duplex devices would
+  // have no fresh input for the frames rendered again.
+  bool rewind_output(uint64_t frame_position) noexcept {
+    if (!_running || _io_mode != audio_device_io_mode::output || _engine_owned)
+      return false;
+
+    _rewind_request.request(frame_position);
+    _wake_event.wake();
+    return true;
+  }
+
+  // Frames written to the output since start(), less those rewound. Inside
+  // the callback, the position of the first frame of its output buffer.
+  // Safe to read from any thread: the processing thread publishes it after
+  // each period and each rewind.
+  uint64_t get_output_frame_position() const noexcept {
+    return _output_position.load(memory_order_acquire);
+  }
+
+  // How much audio just ahead of the hardware pointer a rewind leaves in
+  // place: the controller may have fetched it already, and the callback
+  // needs the time to render what follows.
+  bool set_rewind_margin(chrono::microseconds margin) {
+    if (_is_busy() || margin.count() < 0)
+      return false;
+
+    _rewind_margin = margin;
+    return true;
+  }
+
+  chrono::microseconds get_rewind_margin() const noexcept {
+    return _rewind_margin;
+  }
+
+  bool is_running() const noexcept  {
+    return _running;
+  }
+
+  void wait() const {
+    assert(false);
+  }
+
+  template <typename _CallbackType>
+  void process(_CallbackType&) {
+    assert(false);
+  }
+
+  constexpr bool has_unprocessed_io() const noexcept {
+    return false;
+  }
+
+private:
+  friend class __audio_device_enumerator;
+  friend class audio_device_descriptor;
+
+  template <typename _SampleType>
+  friend class audio_device_engine;
+
+  template <typename _SampleType>
+  using __alsa_callback_t = __alsa_inline_callback<void(audio_device&, audio_device_io<_SampleType>&)>;
+
+  template <typename _SampleType, typename _CallbackType>
+  void _connect_helper(_CallbackType&& callback) {
+    if (_is_busy())
+      throw audio_device_exception("cannot connect to running audio_device");
+
+    _set_sample_type_helper<_SampleType>();
+    _user_callback = __alsa_callback_t<_SampleType>(forward<_CallbackType>(callback));
+  }
+
+  bool _is_connected() const noexcept {
+    if (_user_callback.valueless_by_exception())
+      return false;
+
+    return visit([](auto&& callback) {
+      return static_cast<bool>(callback);
+    }, _user_callback);
+  }
+
+  template <typename _SampleType>
+  bool _set_sample_type_helper() {
+    if (_supports_audio_format(__alsa_native_format<_SampleType>)) {
+      _audio_format = __alsa_native_format<_SampleType>;
+      return true;
+    }
+
+    for (auto format : _convertible_audio_formats) {
+      if (_supports_audio_format(format)) {
+        _audio_format = format;
+        break;
+      }
+    }
+    return false;
+  }
+
+  bool _supports_audio_format(snd_pcm_format_t format) const noexcept {
+    const auto& formats = _capabilities->audio_formats;
+    return find(begin(formats), end(formats), format) != end(formats);
+  }
+
+  static bool _is_convertible(snd_pcm_format_t format) noexcept {
+    return find(begin(_convertible_audio_formats), end(_convertible_audio_formats), format) != end(_convertible_audio_formats);
+  }
+
+  // Probes the device unless the capabilities were probed already.
+  audio_device(device_id_t device_id, string name, __alsa_stream_config config, audio_device_io_mode io_mode,
+               shared_ptr<const __alsa_device_capabilities> capabilities = nullptr)
+  : _device_id(device_id),
+    _io_mode(io_mode),
+    _event_reporter(make_unique<__alsa_event_reporter>(&__alsa_event_reporter::log_event)),
+    _stats(make_unique<__alsa_stats_recorder>()),
+    _name(move(name)),
+    _config(config),
+    _num_channels(config)
+    {
+    assert(!_name.empty());
+//    assert(config.input_config.mNumberBuffers == 0 || config.input_config.mNumberBuffers == 1);
+//    assert(config.output_config.mNumberBuffers == 0 || config.output_config.mNumberBuffers == 1);
+
+    if (!_supports_io_mode(_io_mode))
+      _io_mode = _config.output_config > 0 ? audio_device_io_mode::output : audio_device_io_mode::input;
+
+    _input_stream.direction = SND_PCM_STREAM_CAPTURE;
+    _output_stream.direction = SND_PCM_STREAM_PLAYBACK;
+
+    // TODO : QUERY CHANNEL MAP HERE
+
+    _capabilities = capabilities ? move(capabilities) : __alsa_capability_cache::get_instance().get(_device_id, _primary_stream().direction);
+    _sample_rate = _capabilities->default_sample_rate();
+
+    _set_sample_type_helper<__coreaudio_native_sample_type>();
+    _buffer_size_frames = _capabilities->default_buffer_size;
+  }
+
+  bool _supports_io_mode(audio_device_io_mode mode) const noexcept {
+    switch (mode) {
+    case audio_device_io_mode::output:
+      return _config.output_config > 0;
+    case audio_device_io_mode::input:
+      return _config.input_config > 0;
+    case audio_device_io_mode::duplex:
+      return _config.input_config > 0 && _config.output_config > 0;
+    }
+    return false;
+  }
+
+  // The stream the device's capabilities are probed on.
+  const __alsa_pcm_stream& _primary_stream() const noexcept {
+    return _io_mode == audio_device_io_mode::input ? _input_stream : _output_stream;
+  }
+
+  __alsa_pcm_stream& _primary_stream() noexcept {
+    return _io_mode == audio_device_io_mode::input ? _input_stream : _output_stream;
+  }
+
+  bool _open_stream(__alsa_pcm_stream& stream, snd_pcm_stream_t direction) {
+    stream.direction = direction;
+    stream.pcm = _device_id.get_pcm(direction);
+    // a probe abandoned by a device list may still hold the PCM
+    if (!stream.is_open() && __alsa_probe_pool::get_instance().wait_for_release(_device_id.get_device_id_str(), _probe_release_timeout))
+      stream.pcm = _device_id.get_pcm(direction);
+    stream.hw_params = _device_id.get_hw_params();
+
+    return stream.is_open() && stream.hw_params;
+  }
+
+  // Installs the device's settings on an open PCM. A PCM configured before
+  // is freed first and keeps its device node open, which is quicker than
+  // opening it again. The sizes granted are kept in the stream; with a
+  // stream to match, its sizes are asked for instead of the device's.
+  bool _configure_stream(__alsa_pcm_stream& stream, audio_device_scheduling scheduling,
+                         const __alsa_pcm_stream* match = nullptr) {
+    const int num_channels = stream.is_capture() ? _num_channels.input_config : _num_channels.output_config;
+    stream.num_channels = num_channels;
+    stream.frames_transferred = 0;
+
+    snd_pcm_t* pcm = stream.get();
+    snd_pcm_hw_params_t* hw_params = stream.hw_params.get();
+    snd_pcm_uframes_t period_size = 0;
+
+    __snd_pcm_sw_params_raai sw_params  = __make_snd_pcm_sw_params();
+
+    if (snd_pcm_state(pcm) != SND_PCM_STATE_OPEN && !__alsa_util::check_error(snd_pcm_hw_free(pcm)))
+      return false;
+
+    if (!__alsa_util::check_error(snd_pcm_hw_params_any(pcm, hw_params)))
+      return false;
+
+    // plugins without a resampler to turn off refuse this, which is fine
+    snd_pcm_hw_params_set_rate_resample(pcm, hw_params, false);
+
+    auto access = [pcm, hw_params]() -> std::optional<snd_pcm_access_t> {
+      for (auto access_type : _permited_access_types) {
+        if (0 == snd_pcm_hw_params_set_access(pcm, hw_params, access_type))
+          return access_type;
+      }
+      return nullopt;
+    }();
+
+    if (!access)
+      return false;
+
+    stream.access_type = access.value();
+    stream.format = _audio_format;
+
+    if (!__alsa_util::check_error(snd_pcm_hw_params_set_channels(pcm, hw_params, num_channels))
+        || !__alsa_util::check_error(snd_pcm_hw_params_set_rate(pcm, hw_params, _sample_rate, 0))
+        || !__alsa_util::check_error(snd_pcm_hw_params_set_format(pcm, hw_params, _audio_format)))
+      return false;
+
+    buffer_size_t buffer_size = _buffer_size_frames;
+    if (_target_latency.count() > 0) {
+      const auto target_frames = static_cast<buffer_size_t>(_target_latency.count() * _sample_rate / 1'000'000);
+      buffer_size = clamp(target_frames, _capabilities->min_buffer_size, _capabilities->max_buffer_size);
+    }
+
+    // The period size and count are hints: a driver that refuses them keeps
+    // its own split of the buffer.
+    if (match) {
+      buffer_size = match->buffer_size;
+      snd_pcm_uframes_t matched_period_size = match->period_size;
+      snd_pcm_hw_params_set_period_size_near(pcm, hw_params, &matched_period_size, nullptr);
+    } else if (_block_size_frames > 0) {
+      // Keep the ring a whole number of blocks so blocks stay period aligned
+      // and only straddle the end of the ring when the hardware refuses.
+      snd_pcm_uframes_t block_period_size = _block_size_frames;
+      snd_pcm_hw_params_set_period_size_near(pcm, hw_params, &block_period_size, nullptr);
+      const buffer_size_t num_blocks = _period_count > 0 ? _period_count : (buffer_size + _block_size_frames - 1) / _block_size_frames;
+      buffer_size = max<buffer_size_t>(2, num_blocks) * _block_size_frames;
+    } else if (_period_count > 0) {
+      unsigned int period_count = _period_count;
+      snd_pcm_hw_params_set_periods_near(pcm, hw_params, &period_count, nullptr);
+    }
+
+    if (!__alsa_util::check_error(snd_pcm_hw_params_set_buffer_size_near(pcm, hw_params, &buffer_size)))
+      return false;
+
+    // Drivers that cannot drop period interrupts keep raising them; the
+    // processing thread just does not wait for them.
+    if (scheduling == audio_device_scheduling::timer)
+      snd_pcm_hw_params_set_period_wakeup(pcm, hw_params, 0);
+
+    if (!__alsa_util::check_error(snd_pcm_hw_params(pcm, hw_params))
+        || !__alsa_util::check_error(snd_pcm_hw_params_get_buffer_size(hw_params, &buffer_size))
+        || !__alsa_util::check_error(snd_pcm_hw_params_get_period_size(hw_params, &period_size, nullptr))
+        || !__alsa_util::check_error(snd_pcm_hw_params_get_periods(hw_params, &stream.period_count, nullptr)))
+      return false;
+
+    _select_channel_map(pcm, num_channels);
+
+    if (_block_size_frames > buffer_size)
+      return false;
+
+    stream.buffer_size = buffer_size;
+    stream.period_size = period_size;
+    stream.can_pause = snd_pcm_hw_params_can_pause(hw_params) == 1;
+
+    // mmap streams are started explicitly once primed; RW streams start by
+    // themselves on the write that completes the prefill
+    const snd_pcm_uframes_t start_threshold = stream.is_capture() ? 0 : _prefill_frames(stream);
+    if (!sw_params
+        || !__alsa_util::check_error(snd_pcm_sw_params_current(pcm, sw_params.get()))
+        || !__alsa_util::check_error(snd_pcm_sw_params_set_start_threshold(pcm, sw_params.get(), start_threshold))
+        || !__alsa_util::check_error(snd_pcm_sw_params_set_avail_min(pcm, sw_params.get(), max(period_size, _block_size_frames))))
+      return false;
+
+    // audio_clock_t is CLOCK_MONOTONIC on Linux. Kernels that cannot stamp
+    // in that clock would hand out wall clock times, which are not used.
+    stream.hardware_timestamps =
+      snd_pcm_sw_params_set_tstamp_mode(pcm, sw_params.get(), SND_PCM_TSTAMP_ENABLE) == 0
+      && snd_pcm_sw_params_set_tstamp_type(pcm, sw_params.get(), SND_PCM_TSTAMP_TYPE_MONOTONIC) == 0;
+
+    return __alsa_util::check_error(snd_pcm_sw_params(pcm, sw_params.get()));
+  }
+
+  // Picks the driver's channel map for the channel count. Fixed maps apply
+  // by themselves. Drivers without maps, or without one this wide, keep
+  // their own channel order.
+  static void _select_channel_map(snd_pcm_t* pcm, int num_channels) {
+    __snd_pcm_chmap_query_raai chmap_query(snd_pcm_query_chmaps(pcm));
+    if (!chmap_query)
+      return;
+
+    for (auto** chmap_iterator = chmap_query.get(); *chmap_iterator != nullptr; ++chmap_iterator) {
+      const auto& chmap = **chmap_iterator;
+      if (chmap.map.channels != static_cast<unsigned int>(num_channels))
+        continue;
+
+      // not being able to pick the map does not stop the device working
+      if (chmap.type != SND_CHMAP_TYPE_FIXED)
+        snd_pcm_set_chmap(pcm, &chmap.map);
+      return;
+    }
+  }
+
+  chrono::microseconds _frames_to_time(snd_pcm_uframes_t frames) const noexcept {
+    if (_sample_rate == 0)
+      return {};
+
+    return chrono::microseconds(frames * 1'000'000 / _sample_rate);
+  }
+
+  // Running on its own or driven by an audio_device_engine: the settings
+  // the PCMs were opened with stay as they are.
+  bool _is_busy() const noexcept {
+    return _running || _engine_owned;
+  }
+
+  bool _set_num_channels(int& num_channels, int max_num_channels, int new_num_channels) {
+    if (_is_busy())
+      return false;
+
+    if (new_num_channels < 1 || new_num_channels > max_num_channels)
+      return false;
+
+    num_channels = new_num_channels;
+    return true;
+  }
+
+  // Opens and configures the PCMs of the current io mode.
+  bool _open_streams(audio_device_scheduling scheduling) {
+    if (!_is_convertible(_audio_format))
+      return false;
+
+    _input_stream.close();
+    _output_stream.close();
+    _streams_linked = false;
+    _configured_settings = nullopt;
+    _paused = false;
+
+    const bool has_input = _io_mode != audio_device_io_mode::output;
+    const bool has_output = _io_mode != audio_device_io_mode::input;
+
+    if (has_output && !_open_stream(_output_stream, SND_PCM_STREAM_PLAYBACK))
+      return false;
+
+    if (has_input && !_open_stream(_input_stream, SND_PCM_STREAM_CAPTURE))
+      return false;
+
+    return _configure_streams(scheduling);
+  }
+
+  // Configures the open PCMs, again if they were configured before.
+  bool _configure_streams(audio_device_scheduling scheduling) {
+    _streams_running = false;
+    _configured_settings = nullopt;
+    // plugins may set up their poll descriptors in hw_params
+    _poll_fd = {};
+    if (_streams_linked)
+      snd_pcm_unlink(_input_stream.get());
+    _streams_linked = false;
+
+    if (_output_stream.is_open() && !_configure_stream(_output_stream, scheduling))
+      return false;
+
+    // In duplex mode capture asks for what playback was granted. Both run
+    // off one wakeup, so a driver that splits them differently is refused.
+    const __alsa_pcm_stream* output = _output_stream.is_open() ? &_output_stream : nullptr;
+    if (_input_stream.is_open() && !_configure_stream(_input_stream, scheduling, output))
+      return false;
+
+    if (output && _input_stream.is_open()
+        && (_input_stream.buffer_size != output->buffer_size || _input_stream.period_size != output->period_size))
+      return false;
+
+    // Linked PCMs start, stop and prepare together. Drivers that cannot link
+    // are started back to back instead.
+    if (_input_stream.is_open() && _output_stream.is_open())
+      _streams_linked = snd_pcm_link(_input_stream.get(), _output_stream.get()) == 0;
+
+    // large enough for any region the ring hands out, in the widest sample type
+    _for_each_stream([this](__alsa_pcm_stream& stream) {
+      const size_t size = max(stream.buffer_size, _block_size_frames) * stream.num_channels * sizeof(int32_t);
+      stream.staging_buffer.assign(size, 0);
+      if (stream.is_mmap())
+        stream.rw_buffer.clear();
+      else
+        stream.rw_buffer.assign(size, 0);
+    });
+
+    _configured_settings = _stream_settings(scheduling);
+    return true;
+  }
+
+  // Stopped or paused PCMs keep their configuration and can be started
+  // again as they are, unless a setting changed since or a PCM was left in
+  // a state only reopening fixes, such as a disconnected device.
+  bool _streams_reusable(audio_device_scheduling scheduling) noexcept {
+    if (_configured_settings != _stream_settings(scheduling))
+      return false;
+
+    bool reusable = true;
+    _for_each_stream([&reusable](__alsa_pcm_stream& stream) {
+      const snd_pcm_state_t state = snd_pcm_state(stream.get());
+      reusable = reusable
+        && (state == SND_PCM_STATE_SETUP || state == SND_PCM_STATE_PREPARED || state == SND_PCM_STATE_PAUSED);
+    });
+    return reusable;
+  }
+
+  __alsa_stream_settings _stream_settings(audio_device_scheduling scheduling) const noexcept {
+    __alsa_stream_settings settings;
+    settings.io_mode = _io_mode;
+    settings.format = _audio_format;
+    settings.sample_rate = _sample_rate;
+    settings.num_input_channels = _num_channels.input_config;
+    settings.num_output_channels = _num_channels.output_config;
+    settings.buffer_size = _buffer_size_frames;
+    settings.block_size = _block_size_frames;
+    settings.target_latency = _target_latency;
+    settings.period_count = _period_count;
+    settings.scheduling = scheduling;
+    settings.prefill_periods = _start_policy.prefill_periods;
+    return settings;
+  }
+
+  bool _start_processing() {
+    _wake_event.clear();
+    if (!_poll_fd.is_open()) {
+      auto poll_fd = __make_alsa_pollfd({_input_stream.get(), _output_stream.get()}, _wake_event);
+      if (!poll_fd.has_value())
+        return false;
+
+      _poll_fd = std::move(poll_fd.value());
+    }
+
+    _running = true;
+
+    _event_reporter->start();
+    _processing_thread = __alsa_thread_util::start_thread(_thread_policy, _thread_policy_status, [this] { run_thread(); });
+    return true;
+  }
+
+  // Brings the streams to RUNNING, as the processing thread would. A few
+  // steps suffice: prepare, prime, start.
+  bool _prime_and_start() noexcept {
+    for (int step = 0; step < 8; ++step) {
+      switch (_advance_state(true)) {
+      case __alsa_run_state::failed:
+        return false;
+      case __alsa_run_state::pending:
+        continue;
+      case __alsa_run_state::running:
+        return true;
+      }
+    }
+    return true;  // the processing thread carries on
+  }
+
+  snd_pcm_uframes_t _prefill_frames(const __alsa_pcm_stream& stream) const noexcept {
+    return stream.prefill_frames(_start_policy.prefill_periods, _block_size_frames);
+  }
+
+  void _arm_first_frame() noexcept {
+    _start_time = audio_clock_t::now();
+    _first_frame_pending = true;
+    _stats->record_first_frame({});
+  }
+
+  void _reset_positions() noexcept {
+    _input_stream.position = 0;
+    _output_stream.position = 0;
+    _publish_output_position();
+    _rewind_request.clear();
+  }
+
+  // Carries out a rewind_output() request: moves the application pointer of
+  // the playback ring back towards the requested position, but no closer
+  // to the hardware pointer than the margin, so that the callback renders
+  // those frames again on this wakeup. Fixed blocks stay aligned. Requests
+  // wait while the stream is still being primed.
+  void _rewind_output() noexcept {
+    __alsa_pcm_stream& stream = _output_stream;
+    if (!_streams_running)
+      return;
+
+    const optional<uint64_t> requested = _rewind_request.take();
+    if (!requested || !stream.is_open() || *requested >= stream.position)
+      return;
+
+    _count_system_calls();
+    const snd_pcm_sframes_t rewindable = snd_pcm_rewindable(stream.get());
+    const auto margin = static_cast<snd_pcm_sframes_t>(_rewind_margin.count() * _sample_rate / 1'000'000);
+    const snd_pcm_uframes_t frames = stream.rewind_frames(*requested, rewindable, margin, _block_size_frames);
+    if (frames == 0)
+      return;
+
+    _count_system_calls();
+    const snd_pcm_sframes_t rewound = snd_pcm_rewind(stream.get(), frames);
+    if (rewound <= 0) {
+      _check_error(static_cast<int>(rewound));
+      return;
+    }
+
+    stream.position -= static_cast<uint64_t>(rewound);
+    _publish_output_position();
+    stream.frames_transferred -= min(stream.frames_transferred, static_cast<uint64_t>(rewound));
+    _stats->record_rewind(static_cast<uint64_t>(rewound));
+  }
+
+  void _measure_first_frame() noexcept {
+    const __alsa_pcm_stream& stream = _primary_stream();
+    if (!stream.is_open())
+      return;
+
+    const auto first_frame = stream.first_frame_time(_sample_rate);
+    if (!first_frame)
+      return;
+
+    _stats->record_first_frame(max(chrono::nanoseconds(0), chrono::duration_cast<chrono::nanoseconds>(*first_frame - _start_time)));
+    _first_frame_pending = false;
+  }
+
+  void _stop_processing() {
+    _join_processing_thread();
+    _drop_streams();
+  }
+
+  void _join_processing_thread() {
+    _running = false;
+    _wake_event.wake();
+
+    if (_processing_thread.joinable())
+      _processing_thread.join();
+
+    _streams_running = false;
+  }
+
+  void _drop_streams() noexcept {
+    _for_each_stream([](__alsa_pcm_stream& stream) {
+      snd_pcm_drop(stream.get());
+    });
+  }
+
+  // Linked PCMs pause and release together, so the second of a pair is
+  // usually found done already. A pause the driver refuses, e.g. because
+  // only one of a linked pair can pause, falls back to a drop.
+  void _pause_streams() noexcept {
+    _for_each_stream([](__alsa_pcm_stream& stream) {
+      switch (stream.pause_action(snd_pcm_state(stream.get()))) {
+      case __alsa_pause_action::pause:
+        if (snd_pcm_pause(stream.get(), 1) >= 0)
+          break;
+        [[fallthrough]];
+      case __alsa_pause_action::drop:
+        snd_pcm_drop(stream.get());
+        break;
+      case __alsa_pause_action::none:
+        break;
+      }
+    });
+  }
+
+  void _release_pause() noexcept {
+    _for_each_stream([](__alsa_pcm_stream& stream) {
+      if (snd_pcm_state(stream.get()) == SND_PCM_STATE_PAUSED && snd_pcm_pause(stream.get(), 0) < 0)
+        snd_pcm_drop(stream.get());
+    });
+  }
+
+  // Runs while the processing thread is stopped, so the streams and the
+  // event ring keep a single writer. The rate is tested on the running PCMs
+  // first, so that a refused rate costs no dropout.
+  bool _switch_sample_rate(sample_rate_t new_sample_rate) {
+    if (!_accepts_sample_rate(new_sample_rate))
+      return false;
+
+    _stop_processing();
+
+    const sample_rate_t old_sample_rate = _sample_rate;
+    _sample_rate = new_sample_rate;
+    if (!_configure_streams(_scheduling)) {
+      _sample_rate = old_sample_rate;
+      if (!_configure_streams(_scheduling)) {
+        _event_reporter->stop();
+        return false;
+      }
+    }
+
+    _timer_scheduler.reset(_primary_stream().buffer_size);
+    if (_sample_rate == new_sample_rate)
+      _report(audio_device_event_type::sample_rate_changed, static_cast<int>(new_sample_rate));
+
+    if (!_start_processing()) {
+      _event_reporter->stop();
+      return false;
+    }
+
+    return _sample_rate == new_sample_rate;
+  }
+
+  // Asks the open PCMs without touching their current configuration.
+  bool _accepts_sample_rate(sample_rate_t sample_rate) {
+    bool accepted = true;
+    _for_each_stream([this, sample_rate, &accepted](__alsa_pcm_stream& stream) {
+      __snd_pcm_hw_params_raai hw_params = _device_id.get_hw_params();
+      accepted = accepted && hw_params
+        && snd_pcm_hw_params_any(stream.get(), hw_params.get()) >= 0
+        && snd_pcm_hw_params_test_rate(stream.get(), hw_params.get(), sample_rate, 0) == 0;
+    });
+    return accepted;
+  }
+
+  template <typename _Function>
+  void _for_each_stream(_Function&& function) {
+    if (_input_stream.is_open())
+      function(_input_stream);
+    if (_output_stream.is_open())
+      function(_output_stream);
+  }
+
+  // An xrun on either side of a duplex pair drops both, so that capture and
+  // playback restart in step.
+  int _restart_streams() noexcept {
+    int err = 0;
+    _streams_running = false;
+    _for_each_stream([this, &err](__alsa_pcm_stream& stream) {
+      if (snd_pcm_state(stream.get()) == SND_PCM_STATE_RUNNING) {
+        _count_system_calls();
+        snd_pcm_drop(stream.get());
+      }
+      if (err >= 0) {
+        _count_system_calls();
+        err = snd_pcm_prepare(stream.get());
+      }
+      stream.frames_transferred = 0;
+    });
+    return err;
+  }
+
+  // The state of the slowest stream: an xrun on either side is an xrun.
+  snd_pcm_state_t _stream_state() noexcept {
+    snd_pcm_state_t state = snd_pcm_state(_primary_stream().get());
+    if (_io_mode == audio_device_io_mode::duplex) {
+      snd_pcm_state_t input_state = snd_pcm_state(_input_stream.get());
+      if (input_state == SND_PCM_STATE_XRUN || input_state == SND_PCM_STATE_SUSPENDED
+          || input_state == SND_PCM_STATE_DISCONNECTED || input_state == SND_PCM_STATE_SETUP)
+        return input_state;
+      if (input_state == SND_PCM_STATE_PREPARED && state == SND_PCM_STATE_RUNNING)
+        return SND_PCM_STATE_PREPARED;
+    }
+    return state;
+  }
+
+  // Frames that can be processed by every open stream, or a negative error.
+  // Without period interrupts the hardware pointer is only current after
+  // asking the driver for it, which snd_pcm_avail does.
+  snd_pcm_sframes_t _available_frames() noexcept {
+    const bool sync = _scheduling == audio_device_scheduling::timer;
+    snd_pcm_sframes_t available = numeric_limits<snd_pcm_sframes_t>::max();
+    _for_each_stream([this, &available, sync](__alsa_pcm_stream& stream) {
+      if (available < 0)
+        return;
+      if (sync)
+        _count_system_calls();
+      snd_pcm_sframes_t stream_available = sync ? snd_pcm_avail(stream.get()) : snd_pcm_avail_update(stream.get());
+      available = min(available, stream_available);
+    });
+    return available;
+  }
+
+  // Frames until the first ring runs out: the playback data still queued,
+  // or the room left in the capture ring. Uses the hardware pointer as
+  // _available_frames last synced it, so it costs no system call; the
+  // watermark covers the frames played since.
+  snd_pcm_uframes_t _timer_headroom() noexcept {
+    snd_pcm_uframes_t headroom = numeric_limits<snd_pcm_uframes_t>::max();
+    _for_each_stream([&headroom](__alsa_pcm_stream& stream) {
+      const snd_pcm_sframes_t available = snd_pcm_avail_update(stream.get());
+      const snd_pcm_uframes_t used = available < 0 ? stream.buffer_size : min(static_cast<snd_pcm_uframes_t>(available), stream.buffer_size);
+      headroom = min(headroom, stream.buffer_size - used);
+    });
+    return headroom;
+  }
+
+  bool _start_streams() noexcept {
+    if (_streams_linked) {
+      _count_system_calls();
+      return _check_error(snd_pcm_start(_primary_stream().get()));
+    }
+
+    bool started = true;
+    _for_each_stream([this, &started](__alsa_pcm_stream& stream) {
+      if (snd_pcm_state(stream.get()) == SND_PCM_STATE_PREPARED) {
+        _count_system_calls();
+        started = _check_error(snd_pcm_start(stream.get())) && started;
+      }
+    });
+    return started;
+  }
+
+  void _count_system_calls(uint64_t count = 1) noexcept {
+    _stats->count_system_calls(count);
+  }
+
+  void _publish_output_position() noexcept {
+    _output_position.store(_output_stream.position, memory_order_release);
+  }
+
+  void run_thread()
+  {
+    while (_running) {
+      switch (_advance_state(true)) {
+      case __alsa_run_state::failed:
+        _stop_on_error();
+        return;
+      case __alsa_run_state::pending:
+        continue;
+      case __alsa_run_state::running:
+        break;
+      }
+
+      int result = _wait_for_period();
+      if (result < 0) {
+        _report(audio_device_event_type::error, -errno);
+        _stop_on_error();
+        return;
+      }
+
+      _count_system_calls(_poll_fd.take_system_calls());
+      if (result > 0) {
+        if (!_running)
+          continue;  // woken by stop()
+
+        // woken by rewind_output(), which a stop() after this read wakes
+        // up from again
+        _count_system_calls();
+        _wake_event.clear();
+      } else {
+        _stats->record_wakeup(audio_clock_t::now());
+      }
+
+      _rewind_output();
+
+      snd_pcm_sframes_t avail = _available_frames();
+      if (avail < 0) {
+        if (_recover(static_cast<int>(avail)) < 0) {
+          _stop_on_error();
+          return;
+        }
+      }
+
+      if (avail > 0) {
+        _process(avail);
+      }
+    }
+  }
+
+  // Returns 0 when there is work, 1 when woken by stop() and -1 on error,
+  // as __alsa_pollfd::wait does.
+  int _wait_for_period() noexcept {
+    switch (_scheduling) {
+    case audio_device_scheduling::timer:
+      return _poll_fd.wait_for(_timer_scheduler.sleep_time(_timer_headroom(), _sample_rate));
+    case audio_device_scheduling::spin:
+      if (_spin_for_period())
+        return _running ? 0 : 1;
+      return _poll_fd.wait();
+    case audio_device_scheduling::interrupt:
+    default:
+      return _poll_fd.wait();
+    }
+  }
+
+  // Spins until every stream has a period (or block) available, a stream
+  // reports an error, or stop() is called. snd_pcm_avail_update reads the
+  // pointer the driver updates on each period interrupt, so on a hw PCM a
+  // spin costs no system call. False once the budget is spent.
+  bool _spin_for_period() noexcept {
+    const snd_pcm_sframes_t wanted = static_cast<snd_pcm_sframes_t>(max(_primary_stream().period_size, _block_size_frames));
+    auto period_ready = [this, wanted] {
+      const snd_pcm_sframes_t avail = _available_frames();
+      return avail < 0 || avail >= wanted || _rewind_request.is_pending();
+    };
+
+    return __alsa_thread_util::spin_until(period_ready, _running, audio_clock_t::now() + _spin_budget);
+  }
+
+  // Moves the streams one step towards RUNNING: prepares them, primes the
+  // playback ring, starts them and recovers them from xruns. With
+  // render_prefill the first playback buffer comes from the callback,
+  // otherwise from silence.
+  //
+  // Once the streams run, the state is not asked again until an error
+  // turns up: a stream that stopped reports it through avail or poll.
+  __alsa_run_state _advance_state(bool render_prefill) noexcept {
+    if (_streams_running)
+      return __alsa_run_state::running;
+
+    snd_pcm_state_t state = _stream_state();
+    switch (state) {
+    case SND_PCM_STATE_SETUP:
+      _check_error(_restart_streams());
+      return __alsa_run_state::pending;
+    case SND_PCM_STATE_PREPARED: {
+      if (_output_stream.is_open()) {
+        _count_system_calls();
+        snd_pcm_sframes_t avail = snd_pcm_avail(_output_stream.get());
+        if (avail < 0) {
+          _report(audio_device_event_type::error, static_cast<int>(avail));
+          return __alsa_run_state::failed;
+        }
+
+        const snd_pcm_uframes_t queued = _output_stream.queued_frames(static_cast<snd_pcm_uframes_t>(avail));
+        const snd_pcm_uframes_t prefill = _prefill_frames(_output_stream);
+        if (queued < prefill) {
+          // In duplex mode there is no input to render the first buffer
+          // from yet, so playback starts on silence.
+          if (_input_stream.is_open() || !render_prefill)
+            _skip_frames(_output_stream, prefill - queued);
+          else
+            _process(prefill - queued);
+          return __alsa_run_state::pending;
+        }
+      }
+
+      _start_streams();
+      return __alsa_run_state::pending;
+    }
+    case SND_PCM_STATE_RUNNING:
+      _streams_running = true;
+      return __alsa_run_state::running;
+    case SND_PCM_STATE_PAUSED:
+      return __alsa_run_state::running;
+    case SND_PCM_STATE_XRUN:
+      return _recover(-EPIPE) < 0 ? __alsa_run_state::failed : __alsa_run_state::pending;
+    case SND_PCM_STATE_SUSPENDED:
+      return _recover(-ESTRPIPE) < 0 ? __alsa_run_state::failed : __alsa_run_state::pending;
+    case SND_PCM_STATE_OPEN:
+    case SND_PCM_STATE_DRAINING:
+    case SND_PCM_STATE_DISCONNECTED:
+      _report(audio_device_event_type::state_changed, state);
+      return __alsa_run_state::failed;
+    default:
+      return __alsa_run_state::pending;
+    }
+  }
+
+  int _recover(int err) noexcept {
+    _streams_running = false;
+    if (err == -EPIPE) {
+      _report(audio_device_event_type::xrun, err);
+      _stats->record_xrun();
+      _timer_scheduler.record_xrun();
+      err = _restart_streams();
+    } else if (err == -ESTRPIPE) {
+      _report(audio_device_event_type::suspend, err);
+      _stats->record_suspend();
+      _for_each_stream([this, &err](__alsa_pcm_stream& stream) {
+        while ((err = snd_pcm_resume(stream.get())) == -EAGAIN && _running) {
+          _count_system_calls(2);
+          poll(NULL, 0, 1);
+        }
+        _count_system_calls();
+      });
+      if (err < 0)
+        err = _restart_streams();
+    }
+
+    if (err < 0)
+      _report(audio_device_event_type::error, err);
+    return err;
+  }
+
+  // Called by the processing thread as it gives up on an error it has
+  // reported: is_running() turns false, and the next stop() or start()
+  // joins the thread and drops the streams.
+  void _stop_on_error() noexcept {
+    _running = false;
+    _report(audio_device_event_type::stopped, 0);
+  }
+
+  // Never blocks: the event is queued for the reporting thread.
+  void _report(audio_device_event_type type, int code) noexcept {
+    _event_reporter->post(type, code);
+  }
+
+  // Processing thread counterpart of __alsa_util::check_error.
+  bool _check_error(int error) noexcept {
+    if (error >= 0)
+      return true;
+
+    _report(audio_device_event_type::error, error);
+    return false;
+  }
+
+/*
+  static OSStatus _device_callback(AudioObjectID device_id,
+                                   const AudioTimeStamp* &* now *&*/ /*,
+                                   const AudioBufferList* input_data,
+                                   const AudioTimeStamp* input_time,
+                                   AudioBufferList* output_data,
+                                   const AudioTimeStamp* output_time,
+                                   void *void_ptr_to_this_device) {
+    assert (void_ptr_to_this_device != nullptr);
+    audio_device& this_device = *reinterpret_cast<audio_device*>(void_ptr_to_this_device);
+
+    _fill_buffers(input_data, input_time, output_data, output_time, this_device._current_buffers);
+
+    invoke(this_device._user_callback, this_device, this_device._current_buffers);
+    return noErr;
+  }
+*/
+  void _process(snd_pcm_uframes_t frames) noexcept {
+    _update_timestamps();
+    visit([this, frames](auto& callback) {
+      if (callback)
+        _fill_buffers(callback, frames);
+      else
+        _skip_frames(frames);
+    }, _user_callback);
+  }
+
+  // Offers all available frames to the callback, or whole blocks of
+  // _block_size_frames in fixed-block mode. snd_pcm_mmap_begin stops at the
+  // end of the ring, so a wrapped region takes a second iteration; in duplex
+  // mode capture and playback each wrap at their own position and a callback
+  // only ever sees the frames that are contiguous in both.
+  //
+  // A stream in the callback's native format is handed to the callback in
+  // place. Otherwise the callback sees the stream's staging buffer, which is
+  // converted from or into the ring.
+  template <typename _SampleType>
+  void _fill_buffers(__alsa_callback_t<_SampleType>& callback, snd_pcm_uframes_t available_frames) noexcept {
+    const snd_pcm_uframes_t block_size = _block_size_frames;
+
+    while (available_frames > 0 && available_frames >= block_size) {
+      snd_pcm_uframes_t frames = block_size > 0 ? block_size : available_frames;
+
+      __alsa_io_regions regions;
+      audio_device_io<_SampleType> device_io;
+      if (!_begin_io(frames, regions, device_io))
+        return;
+
+      const auto callback_start = audio_clock_t::now();
+      callback(*this, device_io);
+      _stats->record_callback(callback_start, audio_clock_t::now(), frames, _sample_rate);
+
+      if (!_end_io<_SampleType>(frames, regions))
+        return;
+
+      available_frames -= frames;
+    }
+  }
+
+  // Maps the next frames of every open stream and points device_io at them.
+  // Outside fixed-block mode frames is cut down to what is contiguous in
+  // both rings.
+  template <typename _SampleType>
+  bool _begin_io(snd_pcm_uframes_t& frames, __alsa_io_regions& regions, audio_device_io<_SampleType>& device_io) noexcept {
+    if (_input_stream.is_open() && !_begin(_input_stream, frames, regions.input))
+      return false;
+    if (_output_stream.is_open() && !_begin(_output_stream, frames, regions.output))
+      return false;
+
+    if (_block_size_frames == 0) {
+      if (_input_stream.is_open())
+        frames = min(frames, regions.input.frames);
+      if (_output_stream.is_open())
+        frames = min(frames, regions.output.frames);
+    }
+
+    regions.input_direct = _is_direct<_SampleType>(_input_stream, regions.input, frames);
+    regions.output_direct = _is_direct<_SampleType>(_output_stream, regions.output, frames);
+
+    if (_input_stream.is_open()) {
+      device_io.input_time = _stream_time(_input_stream);
+      if (regions.input_direct) {
+        device_io.input_buffer = _make_buffer<_SampleType>(_input_stream, regions.input, frames);
+      } else {
+        if (!_transfer<_SampleType>(_input_stream, regions.input, frames))
+          return false;
+        device_io.input_buffer = _make_staging_buffer<_SampleType>(_input_stream, frames);
+      }
+    }
+    if (_output_stream.is_open()) {
+      device_io.output_time = _stream_time(_output_stream);
+      device_io.output_buffer = regions.output_direct
+        ? _make_buffer<_SampleType>(_output_stream, regions.output, frames)
+        : _make_staging_buffer<_SampleType>(_output_stream, frames);
+    }
+    return true;
+  }
+
+  // Hands the frames the callback has seen back to the rings.
+  template <typename _SampleType>
+  bool _end_io(snd_pcm_uframes_t frames, __alsa_io_regions& regions) noexcept {
+    if (regions.input_direct && !_commit(_input_stream, regions.input.offset, frames))
+      return false;
+    if (_output_stream.is_open()) {
+      const bool written = regions.output_direct ? _commit(_output_stream, regions.output.offset, frames)
+                                                 : _transfer<_SampleType>(_output_stream, regions.output, frames);
+      _publish_output_position();
+      if (!written)
+        return false;
+    }
+
+    _input_stream.frames_processed += frames;
+    _output_stream.frames_processed += frames;
+    return true;
+  }
+
+  // snd_pcm_htimestamp reads the timestamp of the last hardware pointer
+  // update together with the matching avail, from the status page the driver
+  // maps in, so this costs no system call on hw devices.
+  //
+  // The primary stream's timestamp also dates the pointer update that woke
+  // the thread, which gives the wakeup delay.
+  void _update_timestamps() noexcept {
+    const auto now = audio_clock_t::now();
+    const __alsa_pcm_stream* delay_stream = _streams_running && _scheduling != audio_device_scheduling::timer
+      ? &_primary_stream() : nullptr;
+    _for_each_stream([this, now, delay_stream](__alsa_pcm_stream& stream) {
+      snd_pcm_uframes_t avail = 0;
+      snd_htimestamp_t tstamp = {};
+      stream.frames_processed = 0;
+
+      if (stream.hardware_timestamps
+          && snd_pcm_htimestamp(stream.get(), &avail, &tstamp) == 0
+          && (tstamp.tv_sec != 0 || tstamp.tv_nsec != 0)) {
+        stream.timestamp = chrono::time_point<audio_clock_t>(chrono::duration_cast<audio_clock_t::duration>(
+          chrono::seconds(tstamp.tv_sec) + chrono::nanoseconds(tstamp.tv_nsec)));
+        stream.timestamp_avail = avail;
+        if (&stream == delay_stream)
+          _stats->record_wakeup_delay(chrono::duration_cast<chrono::nanoseconds>(now - stream.timestamp));
+        return;
+      }
+
+      // not running yet, or a plugin without timestamps: assume the wakeup
+      // was on time
+      snd_pcm_sframes_t current_avail = snd_pcm_avail_update(stream.get());
+      stream.timestamp = now;
+      stream.timestamp_avail = current_avail > 0 ? static_cast<snd_pcm_uframes_t>(current_avail) : 0;
+    });
+
+    if (_first_frame_pending)
+      _measure_first_frame();
+  }
+
+  // Playback: the next frame handed to the callback is presented once
+  // everything queued ahead of it has played. Capture: the oldest
+  // frame in the ring was captured timestamp_avail frames before the stamp.
+  chrono::time_point<audio_clock_t> _stream_time(const __alsa_pcm_stream& stream) const noexcept {
+    snd_pcm_sframes_t frames = static_cast<snd_pcm_sframes_t>(stream.frames_processed);
+    if (stream.is_capture())
+      frames -= static_cast<snd_pcm_sframes_t>(stream.timestamp_avail);
+    else
+      frames += static_cast<snd_pcm_sframes_t>(stream.buffer_size) - static_cast<snd_pcm_sframes_t>(stream.timestamp_avail);
+
+    return stream.timestamp + chrono::duration_cast<audio_clock_t::duration>(
+      chrono::nanoseconds(frames * 1'000'000'000 / static_cast<snd_pcm_sframes_t>(_sample_rate)));
+  }
+
+  template <typename _SampleType>
+  static bool _is_direct(const __alsa_pcm_stream& stream, const __alsa_mmap_region& region, snd_pcm_uframes_t frames) noexcept {
+    return stream.is_open() && stream.is_mmap() && stream.is_native<_SampleType>() && region.frames >= frames;
+  }
+
+  // Moves frames between the staging buffer and the ring, starting at an
+  // already begun region and continuing past the wrap.
+  template <typename _SampleType>
+  bool _transfer(__alsa_pcm_stream& stream, __alsa_mmap_region region, snd_pcm_uframes_t frames) noexcept {
+    if (!stream.is_mmap())
+      return _transfer_rw<_SampleType>(stream, frames);
+
+    snd_pcm_uframes_t transferred = 0;
+    while (true) {
+      const snd_pcm_uframes_t region_frames = min(region.frames, frames - transferred);
+      _SampleType* staging = stream.staging_data<_SampleType>(transferred);
+
+      switch (stream.format) {
+      case SND_PCM_FORMAT_FLOAT_LE:
+        _transfer_areas<float>(stream, staging, region, region_frames);
+        break;
+      case SND_PCM_FORMAT_S32_LE:
+        _transfer_areas<int32_t>(stream, staging, region, region_frames);
+        break;
+      case SND_PCM_FORMAT_S16_LE:
+        _transfer_areas<int16_t>(stream, staging, region, region_frames);
+        break;
+      default:
+        return false;
+      }
+
+      if (!_commit(stream, region.offset, region_frames))
+        return false;
+
+      transferred += region_frames;
+      if (transferred == frames)
+        return true;
+
+      if (!_begin(stream, frames - transferred, region))
+        return false;
+    }
+  }
+
+  // Reads or writes the staging buffer directly when it is in the device
+  // format, otherwise through the stream's rw_buffer.
+  template <typename _SampleType>
+  bool _transfer_rw(__alsa_pcm_stream& stream, snd_pcm_uframes_t frames) noexcept {
+    _SampleType* staging = stream.staging_data<_SampleType>();
+    if (stream.is_native<_SampleType>())
+      return _read_write(stream, staging, frames);
+
+    const size_t num_samples = frames * static_cast<size_t>(stream.num_channels);
+    if (!stream.is_capture() && !_convert_rw<_SampleType>(stream, staging, num_samples))
+      return false;
+
+    if (!_read_write(stream, stream.rw_buffer.data(), frames))
+      return false;
+
+    return !stream.is_capture() || _convert_rw<_SampleType>(stream, staging, num_samples);
+  }
+
+  template <typename _SampleType>
+  static bool _convert_rw(__alsa_pcm_stream& stream, _SampleType* staging, size_t num_samples) noexcept {
+    switch (stream.format) {
+    case SND_PCM_FORMAT_FLOAT_LE:
+      _convert_rw_samples<float>(stream, staging, num_samples);
+      return true;
+    case SND_PCM_FORMAT_S32_LE:
+      _convert_rw_samples<int32_t>(stream, staging, num_samples);
+      return true;
+    case SND_PCM_FORMAT_S16_LE:
+      _convert_rw_samples<int16_t>(stream, staging, num_samples);
+      return true;
+    default:
+      return false;
+    }
+  }
 
-    if (!__alsa_util::check_error(snd_pcm_hw_params (pcm.get(), hw_params.get())))
-      return {};
+  template <typename _DeviceSampleType, typename _SampleType>
+  static void _convert_rw_samples(__alsa_pcm_stream& stream, _SampleType* staging, size_t num_samples) noexcept {
+    auto* device_samples = reinterpret_cast<_DeviceSampleType*>(stream.rw_buffer.data());
+    if (stream.is_capture())
+      __alsa_sample_converter::convert(device_samples, staging, num_samples);
+    else
+      __alsa_sample_converter::convert(staging, device_samples, num_samples);
+  }
 
-    snd_pcm_uframes_t frames {};
+  // Only ever asked for frames the PCM reported available, so a short
+  // transfer means the stream stopped underneath.
+  bool _read_write(__alsa_pcm_stream& stream, void* data, snd_pcm_uframes_t frames) noexcept {
+    _count_system_calls();
+    const snd_pcm_sframes_t transferred = stream.is_capture()
+      ? snd_pcm_readi(stream.get(), data, frames)
+      : snd_pcm_writei(stream.get(), data, frames);
+    if (transferred < 0)
+      return _check_error(static_cast<int>(transferred));
+
+    stream.frames_transferred += static_cast<uint64_t>(transferred);
+    stream.position += static_cast<uint64_t>(transferred);
+    return static_cast<snd_pcm_uframes_t>(transferred) == frames;
+  }
 
-    if (!__alsa_util::check_error(snd_pcm_hw_params_get_buffer_size(hw_params.get(), &frames)))
-      return {};
+  template <typename _DeviceSampleType, typename _SampleType>
+  static void _transfer_areas(const __alsa_pcm_stream& stream, _SampleType* staging,
+                              const __alsa_mmap_region& region, snd_pcm_uframes_t frames) noexcept {
+    const size_t num_channels = static_cast<size_t>(stream.num_channels);
+
+    if (stream.access_type == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+      _DeviceSampleType* ring = _area_ptr<_DeviceSampleType>(region.areas[0], region.offset);
+      if (stream.is_capture())
+        __alsa_sample_converter::convert(ring, staging, frames * num_channels);
+      else
+        __alsa_sample_converter::convert(staging, ring, frames * num_channels);
+      return;
+    }
 
-    return frames;
+    for (size_t channel = 0; channel < num_channels; ++channel) {
+      _DeviceSampleType* ring = _area_ptr<_DeviceSampleType>(region.areas[channel], region.offset);
+      const size_t step = region.areas[channel].step / (8 * sizeof(_DeviceSampleType));
+      for (snd_pcm_uframes_t frame = 0; frame < frames; ++frame) {
+        _SampleType& sample = staging[frame * num_channels + channel];
+        _DeviceSampleType& device_sample = ring[frame * step];
+        if (stream.is_capture())
+          sample = __alsa_sample_converter::convert_sample<_DeviceSampleType, _SampleType>(device_sample);
+        else
+          device_sample = __alsa_sample_converter::convert_sample<_SampleType, _DeviceSampleType>(sample);
+      }
+    }
   }
 
-  bool set_buffer_size_frames(buffer_size_t new_buffer_size) {
+  // Keeps a device without a callback running on silence.
+  void _skip_frames(snd_pcm_uframes_t frames) noexcept {
+    _for_each_stream([this, frames](__alsa_pcm_stream& stream) {
+      _skip_frames(stream, frames);
+    });
+  }
 
-    if (new_buffer_size < _min_supported_buffer_size || new_buffer_size > _max_supported_buffer_size)
-      return false;
+  // Writes silence to playback, or drops captured frames.
+  void _skip_frames(__alsa_pcm_stream& stream, snd_pcm_uframes_t frames) noexcept {
+    if (!stream.is_mmap()) {
+      _skip_frames_rw(stream, frames);
+      return;
+    }
 
-    if (!__alsa_util::check_error(snd_pcm_hw_params_set_buffer_size_near(_device_pcm.get(), _hw_params.get(), &new_buffer_size)) )
-      return false;
+    while (frames > 0) {
+      __alsa_mmap_region region;
+      if (!_begin(stream, frames, region))
+        return;
+
+      if (!stream.is_capture())
+        _check_error(snd_pcm_areas_silence(region.areas, region.offset, stream.num_channels, region.frames, stream.format));
+      if (!_commit(stream, region.offset, region.frames))
+        return;
+
+      frames -= region.frames;
+    }
+  }
+
+  // rw_buffer holds as many frames as the staging buffer, whatever the format.
+  void _skip_frames_rw(__alsa_pcm_stream& stream, snd_pcm_uframes_t frames) noexcept {
+    const size_t num_channels = static_cast<size_t>(stream.num_channels);
+    const snd_pcm_uframes_t chunk_frames = stream.rw_buffer.size() / (num_channels * sizeof(int32_t));
+
+    while (frames > 0) {
+      const snd_pcm_uframes_t chunk = min(frames, chunk_frames);
+      if (!stream.is_capture())
+        _check_error(snd_pcm_format_set_silence(stream.format, stream.rw_buffer.data(), chunk * num_channels));
+      if (!_read_write(stream, stream.rw_buffer.data(), chunk))
+        return;
+
+      frames -= chunk;
+    }
+  }
+
+  // PCMs without mmap access take any number of frames at once; they are
+  // only copied when the callback is done.
+  bool _begin(__alsa_pcm_stream& stream, snd_pcm_uframes_t frames, __alsa_mmap_region& region) noexcept {
+    if (!stream.is_mmap()) {
+      region = {nullptr, 0, frames};
+      return frames > 0;
+    }
+
+    region.frames = frames;
+    return _check_error(snd_pcm_mmap_begin(stream.get(), &region.areas, &region.offset, &region.frames)) && region.frames > 0;
+  }
 
-    return __alsa_util::check_error(snd_pcm_hw_params_get_buffer_size(_hw_params.get(), &_buffer_size_frames));
+  bool _commit(__alsa_pcm_stream& stream, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames) noexcept {
+    snd_pcm_sframes_t committed = snd_pcm_mmap_commit(stream.get(), offset, frames);
+    if (committed < 0)
+      return _check_error(static_cast<int>(committed));
+
+    stream.frames_transferred += static_cast<uint64_t>(committed);
+    stream.position += static_cast<uint64_t>(committed);
+    return static_cast<snd_pcm_uframes_t>(committed) == frames;
   }
 
   template <typename _SampleType>
-  constexpr bool supports_sample_type() const noexcept {
-    return is_same_v<_SampleType, __coreaudio_native_sample_type>;
+  static _SampleType* _area_ptr(const snd_pcm_channel_area_t& area, snd_pcm_uframes_t offset) noexcept {
+    return reinterpret_cast<_SampleType*>(static_cast<char*>(area.addr) + (area.first + offset * area.step) / 8);
   }
 
-  constexpr bool can_connect() const noexcept {
-    return true;
+  template <typename _SampleType>
+  static audio_buffer<_SampleType> _make_buffer(const __alsa_pcm_stream& stream, const __alsa_mmap_region& region,
+                                                snd_pcm_uframes_t frames) noexcept {
+    const size_t num_channels = static_cast<size_t>(stream.num_channels);
+    if (stream.access_type == SND_PCM_ACCESS_MMAP_INTERLEAVED)
+      return {_area_ptr<_SampleType>(region.areas[0], region.offset), frames, num_channels, contiguous_interleaved};
+
+    array<_SampleType*, __audio_buffer_max_num_channels> channels = {};
+    for (size_t channel = 0; channel < num_channels; ++channel)
+      channels[channel] = _area_ptr<_SampleType>(region.areas[channel], region.offset);
+
+    return {channels.data(), frames, num_channels, ptr_to_ptr_deinterleaved};
   }
 
-  constexpr bool can_process() const noexcept {
-    return false;
+  template <typename _SampleType>
+  static audio_buffer<_SampleType> _make_staging_buffer(__alsa_pcm_stream& stream, snd_pcm_uframes_t frames) noexcept {
+    return {stream.staging_data<_SampleType>(), frames, static_cast<size_t>(stream.num_channels), contiguous_interleaved};
   }
 
-  template <typename _CallbackType,
-            typename = enable_if_t<is_nothrow_invocable_v<_CallbackType, audio_device&, audio_device_io<__coreaudio_native_sample_type >&>>>
-  void connect(_CallbackType callback) {
-    if (_running)
-      throw audio_device_exception("cannot connect to running audio_device");
+                                   /*
+  static void _fill_buffers(const AudioBufferList* input_bl,
+                            const AudioTimeStamp* input_time,
+                            const AudioBufferList* output_bl,
+                            const AudioTimeStamp* output_time,
+                            audio_device_io<__coreaudio_native_sample_type>& buffers) {
+    assert(input_bl != nullptr);
+    assert(output_bl != nullptr);
+
+    const size_t num_input_buffers = input_bl->mNumberBuffers;
+    assert(num_input_buffers == 0 || num_input_buffers == 1);
+
+    const size_t num_output_buffers = output_bl->mNumberBuffers;
+    assert(num_output_buffers == 0 || num_output_buffers == 1);
+
+    if (num_input_buffers == 1) {
+      buffers.input_buffer = coreaudio_buffer_to_buffer(input_bl->mBuffers[0]);
+      buffers.input_time = coreaudio_timestamp_to_timepoint (input_time);
+    }
 
-    _user_callback = move(callback);
+    if (num_output_buffers == 1) {
+      buffers.output_buffer = coreaudio_buffer_to_buffer(output_bl->mBuffers[0]);
+      buffers.output_time = coreaudio_timestamp_to_timepoint (output_time);
+    }
   }
+*/
+/*  static audio_buffer<__coreaudio_native_sample_type> coreaudio_buffer_to_buffer(const AudioBuffer& ca_buffer) {
+    // TODO: allow different sample types here! It will possibly be int16_t instead of float on iOS!
 
-  // TODO: remove std::function as soon as C++20 default-ctable lambda and lambda in unevaluated contexts become available
-  using no_op_t = std::function<void(audio_device&)>;
+    auto* data_ptr = reinterpret_cast<__coreaudio_native_sample_type*>(ca_buffer.mData);
+    const size_t num_channels = ca_buffer.mNumberChannels;
+    const size_t num_frames = ca_buffer.mDataByteSize / sizeof(__coreaudio_native_sample_type) / num_channels;
 
-  template <typename _StartCallbackType = no_op_t,
-            typename _StopCallbackType = no_op_t,
-            // TODO: is_nothrow_invocable_t does not compile, temporarily replaced with is_invocable_t
-            typename = enable_if_t<is_invocable_v<_StartCallbackType, audio_device&> && is_invocable_v<_StopCallbackType, audio_device&>>>
-  bool start(_StartCallbackType&& start_callback = [](audio_device&) noexcept {},
-             _StopCallbackType&& stop_callback = [](audio_device&) noexcept {}) {
-    if (!_running) {
+    return {data_ptr, num_frames, num_channels, contiguous_interleaved};
+  }
+
+  static audio_clock_t::time_point coreaudio_timestamp_to_timepoint(const AudioTimeStamp* timestamp) {
+    auto count = static_cast<audio_clock_t::rep>(timestamp->mHostTime);
+    return audio_clock_t::time_point() + audio_clock_t::duration(count);
+  }*/
+
+  inline static constexpr int _alsa_invalid_parameter = -22;
 
-      _device_pcm = _device_id.get_pcm();
-      _hw_params = _device_id.get_hw_params();
+  // mmap hands the ring to the callback without copying. Plugins that
+  // cannot map it, such as file, are read and written through a copy.
+  inline static constexpr auto _permited_access_types = __array_of<snd_pcm_access_t>(
+      SND_PCM_ACCESS_MMAP_INTERLEAVED,
+      SND_PCM_ACCESS_MMAP_NONINTERLEAVED,
+      SND_PCM_ACCESS_RW_INTERLEAVED
+  );
+  // how long start() waits for an abandoned probe to close the PCM
+  inline static constexpr auto _probe_release_timeout = chrono::seconds(1);
 
-      snd_pcm_uframes_t period_size = 0;
+  // The formats __alsa_sample_converter handles, most precise first.
+  inline static constexpr auto _convertible_audio_formats = __array_of<snd_pcm_format_t>(
+      SND_PCM_FORMAT_S32_LE,
+      SND_PCM_FORMAT_FLOAT_LE,
+      SND_PCM_FORMAT_S16_LE
+     );
 
-      __snd_pcm_chmap_raai chmap = __make_snd_pcm_chmap(_config.output_config);
-      __snd_pcm_sw_params_raai sw_params  = __make_snd_pcm_sw_params();
+  sample_rate_t _sample_rate {};
+  snd_pcm_format_t _audio_format {};
+  buffer_size_t _buffer_size_frames {};
+  buffer_size_t _block_size_frames {};
+  chrono::microseconds _target_latency {};
+  unsigned int _period_count = 0;
+  // kept for the device's lifetime, so rewind_output() can wake the thread
+  // while _poll_fd is set up again
+  __alsa_wake_event _wake_event;
+  __alsa_pollfd _poll_fd {};
 
-      __alsa_util::check_error(snd_pcm_hw_params_any(_device_pcm.get(), _hw_params.get()));
-      __alsa_util::check_error(snd_pcm_hw_params_set_rate_resample(_device_pcm.get(), _hw_params.get(), false));
+  shared_ptr<const __alsa_device_capabilities> _capabilities;
 
-      auto access = [this]() -> std::optional<snd_pcm_access_t> {
-        for (auto access_type : _permited_access_types) {
-          if (0 == snd_pcm_hw_params_set_access(_device_pcm.get(), _hw_params.get(), access_type))
-            return access_type;
-        }
-        return nullopt;
-      }();
+  __alsa_audio_device_id _device_id = {};
 
-      if (!access)
-        return false;
+  audio_device_io_mode _io_mode = audio_device_io_mode::output;
+  __alsa_pcm_stream _input_stream;
+  __alsa_pcm_stream _output_stream;
+  bool _streams_linked = false;
+  optional<__alsa_stream_settings> _configured_settings;
+  bool _paused = false;
+  // set while an audio_device_engine drives the device
+  bool _engine_owned = false;
 
-      _access_type = access.value();
+  thread _processing_thread;
+  atomic<bool> _running = false;
+  audio_thread_policy _thread_policy = {};
+  audio_thread_policy_status _thread_policy_status = {};
+  audio_device_scheduling _scheduling = audio_device_scheduling::interrupt;
+  __alsa_timer_scheduler _timer_scheduler;
+  audio_device_start_policy _start_policy = {};
+  chrono::microseconds _spin_budget = chrono::milliseconds(1);
+  chrono::microseconds _rewind_margin = chrono::milliseconds(2);
+  __alsa_rewind_request _rewind_request;
+  // _output_stream.position, for get_output_frame_position() on other threads
+  atomic<uint64_t> _output_position = 0;
+  // processing thread only, once started
+  chrono::time_point<audio_clock_t> _start_time = {};
+  bool _first_frame_pending = false;
+  bool _streams_running = false;
+  unique_ptr<__alsa_event_reporter> _event_reporter;
+  unique_ptr<__alsa_stats_recorder> _stats;
 
-      __alsa_util::check_error(snd_pcm_hw_params_set_channels(_device_pcm.get(), _hw_params.get(), this->_config.output_config));
-      __alsa_util::check_error(snd_pcm_hw_params_set_rate(_device_pcm.get(), _hw_params.get(), _sample_rate, SND_PCM_STREAM_PLAYBACK));
-      __alsa_util::check_error(snd_pcm_hw_params_set_format(_device_pcm.get(), _hw_params.get(), _audio_format));
+  string _name = {};
+  __alsa_stream_config _config;
+  __alsa_stream_config _num_channels;
 
+  variant<__alsa_callback_t<float>, __alsa_callback_t<int32_t>, __alsa_callback_t<int16_t>> _user_callback;
+  audio_device_io<__coreaudio_native_sample_type> _current_buffers;
+};
 
-      __alsa_util::check_error(snd_pcm_hw_params_set_buffer_size_near(_device_pcm.get(), _hw_params.get(), &_buffer_size_frames));
-      __alsa_util::check_error(snd_pcm_hw_params_get_buffer_size(_hw_params.get(), &_buffer_size_frames));
+class audio_device_list : public forward_list<audio_device> {
+};
 
-      __alsa_util::check_error(snd_pcm_hw_params(_device_pcm.get(), _hw_params.get()));
+// What enumeration knows about a device without opening it: no PCM is
+// probed and no handles are held. open() constructs the full audio_device,
+// in the mode of the list the descriptor came from.
+class audio_device_descriptor {
+public:
+  using device_id_t = audio_device::device_id_t;
 
-      __alsa_util::check_error(snd_pcm_set_chmap(_device_pcm.get(), chmap.get()));
+  string_view name() const noexcept {
+    return _name;
+  }
 
-      __alsa_util::check_error(snd_pcm_hw_params_get_period_size(_hw_params.get(), &period_size, nullptr));
-      __alsa_util::check_error(snd_pcm_sw_params_current(_device_pcm.get(), sw_params.get()));
-      __alsa_util::check_error(snd_pcm_sw_params_set_start_threshold(_device_pcm.get(), sw_params.get(), 0));
-      __alsa_util::check_error(snd_pcm_sw_params_set_avail_min(_device_pcm.get(), sw_params.get(), period_size));
+  device_id_t device_id() const noexcept {
+    return _device_id;
+  }
 
-      __alsa_util::check_error(snd_pcm_sw_params(_device_pcm.get(), sw_params.get()));
+  bool is_input() const noexcept {
+    return get_num_input_channels() > 0;
+  }
 
-      auto poll_fd = __make_alsa_pollfd(_device_pcm.get());
-      if (!poll_fd.has_value())
+  bool is_output() const noexcept {
+    return get_num_output_channels() > 0;
+  }
+
+  int get_num_input_channels() const noexcept {
+    return _config.input_config;
+  }
+
+  int get_num_output_channels() const noexcept {
+    return _config.output_config;
+  }
+
+  audio_device open() const {
+    return {_device_id, _name, _config, _io_mode};
+  }
+
+private:
+  friend class __audio_device_enumerator;
+
+  audio_device _open(shared_ptr<const __alsa_device_capabilities> capabilities) const {
+    return {_device_id, _name, _config, _io_mode, move(capabilities)};
+  }
+
+  // matches audio_device::_primary_stream
+  snd_pcm_stream_t _probe_direction() const noexcept {
+    return _io_mode == audio_device_io_mode::input ? SND_PCM_STREAM_CAPTURE : SND_PCM_STREAM_PLAYBACK;
+  }
+
+  audio_device_descriptor(device_id_t device_id, string name, __alsa_stream_config config, audio_device_io_mode io_mode)
+    : _device_id(device_id),
+      _name(move(name)),
+      _config(config),
+      _io_mode(io_mode) {
+  }
+
+  device_id_t _device_id;
+  string _name;
+  __alsa_stream_config _config;
+  audio_device_io_mode _io_mode;
+};
+
+class audio_device_descriptor_list : public forward_list<audio_device_descriptor> {
+};
+
+// Drives several devices from a single processing thread. The poll
+// descriptors of all their PCMs share one poll set, and every wakeup hands
+// one block per device to a single callback, with the devices in the order
+// they were added. Devices must outlive the engine's run and are started
+// and stopped through it.
+//
+// Devices on separate clocks drift apart. The engine does not resample: the
+// device running ahead eventually xruns and is recovered as usual.
+template <typename _SampleType>
+class audio_device_engine {
+public:
+  using io_list_t = vector<audio_device_io<_SampleType>>;
+
+  audio_device_engine() = default;
+  audio_device_engine(const audio_device_engine&) = delete;
+  audio_device_engine& operator=(const audio_device_engine&) = delete;
+
+  ~audio_device_engine() {
+    stop();
+  }
+
+  bool add_device(audio_device& device) {
+    if (_running || device.is_running())
+      return false;
+
+    if (find(begin(_devices), end(_devices), &device) != end(_devices))
+      return false;
+
+    _devices.push_back(&device);
+    return true;
+  }
+
+  size_t get_num_devices() const noexcept {
+    return _devices.size();
+  }
+
+  // Every device is opened in fixed-block mode with this block size.
+  bool set_block_size_frames(audio_device::buffer_size_t block_size) {
+    if (_running || block_size == 0)
+      return false;
+
+    _block_size_frames = block_size;
+    return true;
+  }
+
+  audio_device::buffer_size_t get_block_size_frames() const noexcept {
+    return _block_size_frames;
+  }
+
+  // The callback receives one audio_device_io per device, indexed in the
+  // order the devices were added.
+  template <typename _CallbackType,
+            typename = enable_if_t<is_nothrow_invocable_v<_CallbackType, audio_device_engine&, io_list_t&>>>
+  void connect(_CallbackType callback) {
+    if (_running)
+      throw audio_device_exception("cannot connect to running audio_device_engine");
+
+    _callback = move(callback);
+  }
+
+  bool start(const audio_thread_policy& policy = {}) {
+    if (_running)
+      return true;
+
+    // a processing thread that stopped on an error is cleaned up first
+    if (_processing_thread.joinable())
+      stop();
+
+    if (!_callback || _devices.empty())
+      return false;
+
+    vector<snd_pcm_t*> pcms;
+    for (size_t i = 0; i < _devices.size(); ++i) {
+      audio_device& device = *_devices[i];
+      if (device.is_running()) {
+        _release_devices(i);
         return false;
+      }
 
-      _poll_fd = std::move(poll_fd.value());
+      device._block_size_frames = _block_size_frames;
+      device._set_sample_type_helper<_SampleType>();
+      device._arm_first_frame();
+      device._reset_positions();
+      // the engine's single thread waits in poll() for all devices
+      if (!device._open_streams(audio_device_scheduling::interrupt)) {
+        _release_devices(i);
+        return false;
+      }
 
-      _running = true;
+      pcms.push_back(device._input_stream.get());
+      pcms.push_back(device._output_stream.get());
+      device._engine_owned = true;
+      device._running = true;
+      device._event_reporter->start();
+    }
 
-      _processing_thread = std::thread(&audio_device::run_thread, this);
+    auto poll_fd = __make_alsa_pollfd(pcms, _wake_event);
+    if (!poll_fd.has_value()) {
+      _release_devices(_devices.size());
+      return false;
     }
 
+    _poll_fd = move(poll_fd.value());
+    _wake_event.clear();
+    _io.assign(_devices.size(), {});
+    _regions.assign(_devices.size(), {});
+    _thread_policy = policy;
+
+    _running = true;
+    _processing_thread = __alsa_thread_util::start_thread(_thread_policy, _thread_policy_status, [this] { run_thread(); });
     return true;
   }
 
   bool stop() {
-    if (_running) {
+    if (_running || _processing_thread.joinable()) {
       _running = false;
+      for (audio_device* device : _devices)
+        device->_running = false;
+      _wake_event.wake();
 
       if (_processing_thread.joinable())
         _processing_thread.join();
 
+      _release_devices(_devices.size());
     }
 
     return true;
   }
 
-  bool is_running() const noexcept  {
+  bool is_running() const noexcept {
     return _running;
   }
 
-  void wait() const {
-    assert(false);
+  audio_thread_policy_status get_thread_policy_status() const noexcept {
+    return _thread_policy_status;
   }
 
-  template <typename _CallbackType>
-  void process(_CallbackType&) {
-    assert(false);
+private:
+  void _release_devices(size_t count) noexcept {
+    for (size_t i = 0; i < count; ++i) {
+      audio_device& device = *_devices[i];
+      device._for_each_stream([](__alsa_pcm_stream& stream) {
+        snd_pcm_drop(stream.get());
+      });
+      device._running = false;
+      device._engine_owned = false;
+      device._event_reporter->stop();
+    }
   }
 
-  constexpr bool has_unprocessed_io() const noexcept {
-    return false;
-  }
+  void run_thread() {
+    while (_running) {
+      bool all_running = true;
+      for (audio_device* device : _devices) {
+        switch (device->_advance_state(false)) {
+        case __alsa_run_state::failed:
+          _stop_on_error();
+          return;
+        case __alsa_run_state::pending:
+          all_running = false;
+          break;
+        case __alsa_run_state::running:
+          break;
+        }
+      }
 
-private:
-  friend class __audio_device_enumerator;
+      if (!all_running)
+        continue;
 
-  struct __snd_pcm_helper {
-    __snd_pcm_helper(const audio_device * device)
-    {
-      if (!device->_device_pcm) {
-        snd_pcm_raai = device->device_id().get_pcm();
-        pcm = snd_pcm_raai.get();
-      } else {
-        pcm = device->_device_pcm.get();
+      int result = _poll_fd.wait();
+      if (result < 0) {
+        _devices.front()->_report(audio_device_event_type::error, -errno);
+        _stop_on_error();
+        return;
       }
-    }
 
-    __snd_pcm_t_raai snd_pcm_raai;
-    snd_pcm_t * pcm;
+      // one poll serves every device, so each is charged for it
+      const uint64_t system_calls = _poll_fd.take_system_calls();
+      for (audio_device* device : _devices)
+        device->_count_system_calls(system_calls);
+
+      if (result > 0)
+        continue;  // woken by stop()
+
+      const auto wakeup_time = audio_clock_t::now();
+      for (audio_device* device : _devices)
+        device->_stats->record_wakeup(wakeup_time);
+
+      // every device must have a block ready; one that xruns is recovered
+      // and the others wait for it to catch up
+      snd_pcm_sframes_t avail = numeric_limits<snd_pcm_sframes_t>::max();
+      bool recovered = false;
+      for (audio_device* device : _devices) {
+        snd_pcm_sframes_t device_avail = device->_available_frames();
+        if (device_avail < 0) {
+          if (device->_recover(static_cast<int>(device_avail)) < 0) {
+            _stop_on_error();
+            return;
+          }
+          recovered = true;
+        }
+        avail = min(avail, device_avail);
+      }
 
-    snd_pcm_t * get() {
-      return pcm;
+      if (!recovered)
+        _process(static_cast<snd_pcm_uframes_t>(avail));
     }
-  };
+  }
 
-  audio_device(device_id_t device_id, string name, __alsa_stream_config config)
-  : _device_id(device_id),
-    _name(move(name)),
-    _config(config)
-    {
-    assert(!_name.empty());
-//    assert(config.input_config.mNumberBuffers == 0 || config.input_config.mNumberBuffers == 1);
-//    assert(config.output_config.mNumberBuffers == 0 || config.output_config.mNumberBuffers == 1);
+  // The engine stops as a whole: every device reports itself stopped.
+  void _stop_on_error() noexcept {
+    _running = false;
+    for (audio_device* device : _devices)
+      device->_stop_on_error();
+  }
 
-    //_device_pcm = _device_id.get_pcm();
-    //_hw_params = _device_id.get_hw_params();
+  void _process(snd_pcm_uframes_t available_frames) noexcept {
+    for (audio_device* device : _devices)
+      device->_update_timestamps();
 
-    // TODO : QUERY CHANNEL MAP HERE
+    while (available_frames >= _block_size_frames) {
+      snd_pcm_uframes_t frames = _block_size_frames;
+      for (size_t i = 0; i < _devices.size(); ++i) {
+        _io[i] = {};
+        if (!_devices[i]->_begin_io(frames, _regions[i], _io[i]))
+          return;
+      }
 
-    _init_supported_sample_rates();
-    _init_supported_buffer_sizes();
-    _init_supported_formats();
-    _buffer_size_frames = get_buffer_size_frames();
-  }
+      const auto callback_start = audio_clock_t::now();
+      _callback(*this, _io);
+      const auto callback_end = audio_clock_t::now();
 
-  void run_thread()
-  {
-    auto recover_xrun = [this](int err)
-    {
-      if (err == -EPIPE) {
-        err = snd_pcm_prepare(_device_pcm.get());
-      } else if (err == -ESTRPIPE) {
-        while ((err = snd_pcm_resume(_device_pcm.get())) == -EAGAIN) {
-          poll(NULL, 0, 1);
-        }
-        if (err < 0)
-          err = snd_pcm_prepare(_device_pcm.get());
+      // the callback served every device, so each is charged for all of it
+      for (audio_device* device : _devices)
+        device->_stats->record_callback(callback_start, callback_end, frames, device->_sample_rate);
+
+      for (size_t i = 0; i < _devices.size(); ++i) {
+        if (!_devices[i]->template _end_io<_SampleType>(frames, _regions[i]))
+          return;
       }
-      return err;
-    };
 
+      available_frames -= frames;
+    }
+  }
 
-    while (_running) {
-      snd_pcm_state_t state = snd_pcm_state(_device_pcm.get());
-      switch (state) {
-      case SND_PCM_STATE_SETUP: {
-        __alsa_util::check_error(snd_pcm_prepare(_device_pcm.get()));
-        continue;
-      }
-      case SND_PCM_STATE_PREPARED: {
-        snd_pcm_sframes_t avail = snd_pcm_avail(_device_pcm.get());
-        if (avail < 0) {
-          std::cout << "SND_PCM_STATE_PREPARED: avail < 0 :" << avail << std::endl;
-          return;
-        }
+  vector<audio_device*> _devices = {};
+  io_list_t _io = {};
+  vector<__alsa_io_regions> _regions = {};
+  __alsa_wake_event _wake_event;
+  __alsa_pollfd _poll_fd {};
+  audio_device::buffer_size_t _block_size_frames = 256;
+
+  thread _processing_thread;
+  atomic<bool> _running = false;
+  audio_thread_policy _thread_policy = {};
+  audio_thread_policy_status _thread_policy_status = {};
 
-        if ((snd_pcm_uframes_t)avail == _buffer_size_frames) {
-          _fill_buffers(avail);
-          continue;
-        }
+  __alsa_inline_callback<void(audio_device_engine&, io_list_t&)> _callback;
+};
 
-        __alsa_util::check_error(snd_pcm_start(_device_pcm.get()));
-        continue;
-      }
-      case SND_PCM_STATE_RUNNING:
-      case SND_PCM_STATE_PAUSED: {
-        int result = _poll_fd.wait();
-        if (result < 0) {
-          std::cout << "this->waitForPoll() = " << result << std::endl;
-          return;
-        }
+class __audio_device_enumerator {
+public:
+  static __audio_device_enumerator& get_instance() {
+    static __audio_device_enumerator cde;
+    return cde;
+  }
 
-        snd_pcm_sframes_t avail = snd_pcm_avail_update(_device_pcm.get());
-        if (avail < 0) {
-          std::cout << "outstream_xrun_recovery :" << avail << std::endl;
-          if (recover_xrun(avail) < 0) {
-            std::cout << "SND_PCM_STATE_PAUSED|SND_PCM_STATE_RUNNING: avail < 0 :" << avail << std::endl;
-            return;
-          }
-        }
+  // The default card comes straight from the sysdefault hint for the
+  // direction, so no device names are compared and only that card's control
+  // device is opened. Without such a hint, the first card with a matching
+  // device is used.
+  optional<audio_device> get_default_io_device(snd_pcm_stream_t direction) {
+    const auto io_mode = direction == SND_PCM_STREAM_CAPTURE ? audio_device_io_mode::input : audio_device_io_mode::output;
 
-        if (avail > 0) {
-          _fill_buffers(avail);
-        }
+    const int default_card_id = get_default_card_id(direction);
+    if (default_card_id >= 0) {
+      if (auto descriptor = find_descriptor_on_card(default_card_id, direction, io_mode))
+        return descriptor->open();
+    }
+
+    int card_id = -1;
+    while (snd_card_next(&card_id) >= 0 && card_id >= 0) {
+      if (card_id == default_card_id)
         continue;
-      }
-      case SND_PCM_STATE_XRUN:
-        if (recover_xrun(-EPIPE) < 0) {
-          std::cout << "SND_PCM_STATE_XRUN" << std::endl;
 
-          return;
-        }
+      if (auto descriptor = find_descriptor_on_card(card_id, direction, io_mode))
+        return descriptor->open();
+    }
 
-        continue;
-      case SND_PCM_STATE_OPEN:
-        std::cout << "SND_PCM_STATE_OPEN" << std::endl;
-        return;
-      case SND_PCM_STATE_DRAINING:
-        std::cout << "SND_PCM_STATE_DRAINING" << std::endl;
-        return;
-      case SND_PCM_STATE_DISCONNECTED:
-        std::cout << "SND_PCM_STATE_DISCONNECTED" << std::endl;
-        return;
-      default:
-        continue;
-      }
+    return nullopt;
+  }
+
+  // A PCM the ALSA configuration defines, opened by name in one direction.
+  // Plugins such as null accept almost any channel count, so the device
+  // opens with stereo whenever its range allows.
+  optional<audio_device> get_named_io_device(string pcm_name, snd_pcm_stream_t direction) {
+    __alsa_audio_device_id device_id;
+    device_id.pcm_name = move(pcm_name);
+
+    const auto [min_channels, max_channels] = get_hw_channel_range(device_id, direction);
+    const int num_channels = usable_channels(min_channels, max_channels);
+    if (num_channels == 0)
+      return nullopt;
+
+    const bool is_capture = direction == SND_PCM_STREAM_CAPTURE;
+    const __alsa_stream_config config = {is_capture ? num_channels : 0, is_capture ? 0 : num_channels};
+
+    audio_device device(device_id, device_id.pcm_name, config,
+                        is_capture ? audio_device_io_mode::input : audio_device_io_mode::output);
+    if (min_channels <= 2) {
+      if (is_capture)
+        device.set_num_input_channels(2);
+      else
+        device.set_num_output_channels(2);
     }
+
+    return device;
   }
 
-/*
-  static OSStatus _device_callback(AudioObjectID device_id,
-                                   const AudioTimeStamp* &* now *&*/ /*,
-                                   const AudioBufferList* input_data,
-                                   const AudioTimeStamp* input_time,
-                                   AudioBufferList* output_data,
-                                   const AudioTimeStamp* output_time,
-                                   void *void_ptr_to_this_device) {
-    assert (void_ptr_to_this_device != nullptr);
-    audio_device& this_device = *reinterpret_cast<audio_device*>(void_ptr_to_this_device);
+  template <typename Condition>
+  auto get_descriptor_list(Condition condition, audio_device_io_mode io_mode) {
+    audio_device_descriptor_list descriptors;
 
-    _fill_buffers(input_data, input_time, output_data, output_time, this_device._current_buffers);
+    for (auto& device : get_devices()) {
+      audio_device_descriptor descriptor(device.device_id, move(device.name), device.config, io_mode);
+      if (condition(descriptor))
+        descriptors.push_front(move(descriptor));
+    }
 
-    invoke(this_device._user_callback, this_device, this_device._current_buffers);
-    return noErr;
-  }
-*/
-  void _fill_buffers(snd_pcm_uframes_t available_frames) {
-    const snd_pcm_channel_area_t *areas;
-    snd_pcm_uframes_t frames = available_frames;
-    snd_pcm_uframes_t offset = 0;
-    __alsa_util::check_error(
-        snd_pcm_mmap_begin(_device_pcm.get(), &areas, &offset, &frames));
-    audio_device_io<int16_t> device_io;
-    if (_access_type == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
-      int16_t* ptr2 = (int16_t *)areas->addr;
-      ptr2 += ( offset * _config.output_config );
-      device_io.output_buffer = audio_buffer<int16_t>(ptr2 , frames,
-                                   _config.output_config,
-                                   contiguous_interleaved);
-
-    } else if (_access_type == SND_PCM_ACCESS_MMAP_NONINTERLEAVED) {
-      int16_t* ptr2 = (int16_t *)areas->addr;
-      ptr2 += ( offset );
-      device_io.output_buffer = audio_buffer<int16_t>((int16_t *)areas->addr, frames,
-                                   _config.output_config,
-                                   contiguous_deinterleaved);
-
-
-    }
-    _user_callback(*this, device_io);
-    snd_pcm_sframes_t committed = snd_pcm_mmap_commit(_device_pcm.get(), offset, frames);
-    assert ( committed == frames );
+    return descriptors;
   }
 
-                                   /*
-  static void _fill_buffers(const AudioBufferList* input_bl,
-                            const AudioTimeStamp* input_time,
-                            const AudioBufferList* output_bl,
-                            const AudioTimeStamp* output_time,
-                            audio_device_io<__coreaudio_native_sample_type>& buffers) {
-    assert(input_bl != nullptr);
-    assert(output_bl != nullptr);
+  // Filters on descriptors, so only the devices returned are probed, and
+  // probes them concurrently. A device whose probe exceeds the timeout is
+  // still listed, without known capabilities.
+  template <typename Condition>
+  auto get_device_list(Condition condition, audio_device_io_mode io_mode) {
+    audio_device_list devices;
+    auto descriptors = get_descriptor_list(condition, io_mode);
 
-    const size_t num_input_buffers = input_bl->mNumberBuffers;
-    assert(num_input_buffers == 0 || num_input_buffers == 1);
+    // both lists are built with push_front, so reverse to keep the order
+    descriptors.reverse();
 
-    const size_t num_output_buffers = output_bl->mNumberBuffers;
-    assert(num_output_buffers == 0 || num_output_buffers == 1);
+    vector<__alsa_probe_pool::job_t> jobs;
+    for (const auto& descriptor : descriptors)
+      jobs.emplace_back(descriptor._device_id, descriptor._probe_direction());
 
-    if (num_input_buffers == 1) {
-      buffers.input_buffer = coreaudio_buffer_to_buffer(input_bl->mBuffers[0]);
-      buffers.input_time = coreaudio_timestamp_to_timepoint (input_time);
-    }
+    auto capabilities = __alsa_probe_pool::get_instance().probe(move(jobs), _probe_timeout);
 
-    if (num_output_buffers == 1) {
-      buffers.output_buffer = coreaudio_buffer_to_buffer(output_bl->mBuffers[0]);
-      buffers.output_time = coreaudio_timestamp_to_timepoint (output_time);
-    }
+    size_t index = 0;
+    for (const auto& descriptor : descriptors)
+      devices.push_front(descriptor._open(move(capabilities[index++])));
+
+    return devices;
   }
-*/
-/*  static audio_buffer<__coreaudio_native_sample_type> coreaudio_buffer_to_buffer(const AudioBuffer& ca_buffer) {
-    // TODO: allow different sample types here! It will possibly be int16_t instead of float on iOS!
 
-    auto* data_ptr = reinterpret_cast<__coreaudio_native_sample_type*>(ca_buffer.mData);
-    const size_t num_channels = ca_buffer.mNumberChannels;
-    const size_t num_frames = ca_buffer.mDataByteSize / sizeof(__coreaudio_native_sample_type) / num_channels;
+  auto get_input_descriptor_list() {
+    return get_descriptor_list(_is_input, audio_device_io_mode::input);
+  }
 
-    return {data_ptr, num_frames, num_channels, contiguous_interleaved};
+  auto get_output_descriptor_list() {
+    return get_descriptor_list(_is_output, audio_device_io_mode::output);
   }
 
-  static audio_clock_t::time_point coreaudio_timestamp_to_timepoint(const AudioTimeStamp* timestamp) {
-    auto count = static_cast<audio_clock_t::rep>(timestamp->mHostTime);
-    return audio_clock_t::time_point() + audio_clock_t::duration(count);
-  }*/
+  auto get_input_device_list() {
+    return get_device_list(_is_input, audio_device_io_mode::input);
+  }
 
-  inline static constexpr int _alsa_invalid_parameter = -22;
+  auto get_output_device_list() {
+    return get_device_list(_is_output, audio_device_io_mode::output);
+  }
 
-  inline static constexpr auto _permited_access_types = __array_of<snd_pcm_access_t>(
-      SND_PCM_ACCESS_MMAP_INTERLEAVED,
-      SND_PCM_ACCESS_MMAP_NONINTERLEAVED
-  );
-  inline static constexpr auto _test_sample_rates = __array_of<size_t>(
-      44100u,
-      48000u,
-      96000u,
-      32000u,
-      22050u,
-      8000u,
-      4000u,
-      192000u);
+  // Once the device list monitor runs, it reports every card that changes,
+  // so what was read from the other cards' control devices stays valid and
+  // is kept between enumerations.
+  void keep_cards() {
+    lock_guard<mutex> lock(_cards_mutex);
+    _keep_cards = true;
+  }
 
-  inline static constexpr auto _test_audio_formats = __array_of<snd_pcm_format_t>(
-      SND_PCM_FORMAT_FLOAT_LE,
-      SND_PCM_FORMAT_S16_LE,
-      SND_PCM_FORMAT_S24_LE,
-      SND_PCM_FORMAT_S32_LE,
-      SND_PCM_FORMAT_FLOAT64_LE,
-      SND_PCM_FORMAT_S8
-     );
+  void refresh_card(int card_id) {
+    lock_guard<mutex> lock(_cards_mutex);
+    auto devices = read_card(card_id);
+    if (devices.empty())
+      _cards.erase(card_id);
+    else
+      _cards[card_id] = move(devices);
+  }
 
-  void _init_supported_formats() {
-    snd_pcm_format_mask_t* format_mask_raw = nullptr;
-    snd_pcm_format_mask_malloc(&format_mask_raw);
+private:
+  friend class __alsa_device_list_monitor;
 
-    __snd_pcm_format_mask_raai format_mask(format_mask_raw);
-    __snd_pcm_hw_params_raai hw_params = _device_id.get_hw_params();
+  __audio_device_enumerator() = default;
 
-    __snd_pcm_helper pcm(this);
+  struct __device_entry {
+    __alsa_audio_device_id device_id;
+    string name;
+    __alsa_stream_config config;
+  };
 
-    __alsa_util::check_error(snd_pcm_hw_params_any(pcm.get(), hw_params.get()));
-    snd_pcm_hw_params_get_format_mask(hw_params.get(), format_mask.get());
+  vector<__device_entry> get_devices() {
+    vector<__device_entry> devices;
+    lock_guard<mutex> lock(_cards_mutex);
 
-    for (auto test_format : _test_audio_formats) {
-      if (snd_pcm_format_mask_test(format_mask.get(), test_format)) {
-        _supported_audio_formats.push_back(test_format);
+    int card_id = -1;
+    while (snd_card_next(&card_id) >= 0 && card_id >= 0) {
+      if (!_keep_cards) {
+        auto card_devices = read_card(card_id);
+        move(begin(card_devices), end(card_devices), back_inserter(devices));
+        continue;
       }
+
+      auto card = _cards.find(card_id);
+      if (card == _cards.end())
+        card = _cards.emplace(card_id, read_card(card_id)).first;
+
+      devices.insert(devices.end(), card->second.begin(), card->second.end());
     }
 
-    if (_supported_audio_formats.size() > 0)
-      _audio_format = _supported_audio_formats[0];
+    return devices;
   }
-  void _init_supported_sample_rates() {
-    __snd_pcm_hw_params_raai hw_params = _device_id.get_hw_params();
-    __snd_pcm_helper pcm(this);
 
-    __alsa_util::check_error(snd_pcm_hw_params_any(pcm.get(), hw_params.get()));
+  // One control device open for all PCMs of the card.
+  static vector<__device_entry> read_card(int card_id) {
+    vector<__device_entry> devices;
 
-    for (auto rate : _test_sample_rates) {
-      int result = snd_pcm_hw_params_test_rate(pcm.get(), hw_params.get(), rate, SND_PCM_STREAM_PLAYBACK);
-      if (result == 0)
-        _supported_sample_rates.push_back(rate);
-    }
+    __alsa_audio_device_id device_id;
+    device_id.card_id = card_id;
 
-    if (_supported_sample_rates.size() > 0)
-      _sample_rate = _supported_sample_rates[0];
+    __snd_ctl_t_raai snd_ctl_handle = device_id.card_handle();
+    if (!snd_ctl_handle)
+      return devices;
+
+    vector<__alsa_audio_device_id> device_ids;
+    while (snd_ctl_pcm_next_device(snd_ctl_handle.get(), &device_id.device_id) >= 0 && device_id.device_id >= 0)
+      device_ids.push_back(device_id);
+
+    auto configs = get_stream_configs(snd_ctl_handle, device_ids);
+    for (size_t i = 0; i < device_ids.size(); ++i)
+      devices.push_back({device_ids[i], device_ids[i].get_device_name(snd_ctl_handle), configs[i]});
+
+    return devices;
   }
 
-  void _init_supported_buffer_sizes() {
+  static int get_default_card_id(snd_pcm_stream_t direction) {
+    void** name_hints_raw = {nullptr};
+    if (snd_device_name_hint(-1, "pcm", &name_hints_raw) < 0 || !name_hints_raw)
+      return -1;
+
+    __snd_device_name_hint_raai name_hints(name_hints_raw);
 
-    __snd_pcm_hw_params_raai hw_params = _device_id.get_hw_params();
-    __snd_pcm_helper pcm(this);
+    constexpr string_view prefix = "sysdefault:CARD=";
+    const char* io_id = direction == SND_PCM_STREAM_CAPTURE ? "Input" : "Output";
+
+    for (void** name_hint_itr = name_hints_raw; *name_hint_itr; ++name_hint_itr) {
+      __snd_hint_string_raai name_raai(snd_device_name_get_hint(*name_hint_itr, "NAME"));
+      if (!name_raai)
+        continue;
 
-    __alsa_util::check_error(snd_pcm_hw_params_any(pcm.get(), hw_params.get()));
+      string_view name(name_raai.get());
+      if (name.substr(0, prefix.size()) != prefix)
+        continue;
 
-    snd_pcm_uframes_t min_frames {};
-    snd_pcm_uframes_t max_frames {};
+      // no IOID means the PCM does both directions
+      __snd_hint_string_raai io_id_raai(snd_device_name_get_hint(*name_hint_itr, "IOID"));
+      if (io_id_raai && strcmp(io_id_raai.get(), io_id) != 0)
+        continue;
 
-    __alsa_util::check_error(snd_pcm_hw_params_get_buffer_size_min(hw_params.get(), &min_frames));
-    __alsa_util::check_error(snd_pcm_hw_params_get_buffer_size_max(hw_params.get(), &max_frames));
+      string card_str(name.substr(prefix.size()));
+      card_str = card_str.substr(0, card_str.find(','));
 
-    _min_supported_buffer_size = static_cast<buffer_size_t>(min_frames);
-    _max_supported_buffer_size = static_cast<buffer_size_t>(max_frames);
+      int card_id = snd_card_get_index(card_str.c_str());
+      if (card_id >= 0)
+        return card_id;
+    }
 
-    // ensure that the supported buffer size range obtained from Wasapi makes sense:
-    // TODO: do this using proper error handling/reporting instead of asserts
-    assert(_min_supported_buffer_size > 0);
-    assert(_max_supported_buffer_size >= _min_supported_buffer_size);
+    return -1;
   }
 
-  snd_pcm_access_t _access_type {};
-  sample_rate_t _sample_rate {};
-  snd_pcm_format_t _audio_format {};
-  buffer_size_t _buffer_size_frames {};
-  __alsa_pollfd _poll_fd {};
+  static optional<audio_device_descriptor> find_descriptor_on_card(int card_id, snd_pcm_stream_t direction, audio_device_io_mode io_mode) {
+    __alsa_audio_device_id device_id;
+    device_id.card_id = card_id;
 
-  vector<sample_rate_t> _supported_sample_rates = {};
-  vector<snd_pcm_format_t> _supported_audio_formats = {};
-  buffer_size_t _min_supported_buffer_size = 0;
-  buffer_size_t _max_supported_buffer_size = 0;
+    __snd_ctl_t_raai snd_ctl_handle = device_id.card_handle();
+    if (!snd_ctl_handle)
+      return nullopt;
 
-  __alsa_audio_device_id _device_id = {};
+    while (snd_ctl_pcm_next_device(snd_ctl_handle.get(), &device_id.device_id) >= 0 && device_id.device_id >= 0) {
+      __snd_pcm_info_t_raai pcm_info = device_id.get_pcm_info(direction);
+      if (!pcm_info || snd_ctl_pcm_info(snd_ctl_handle.get(), pcm_info.get()) < 0)
+        continue;
 
-  __snd_pcm_t_raai _device_pcm;
-  __snd_pcm_hw_params_raai _hw_params;
+      auto descriptor = get_descriptor(device_id, io_mode, snd_ctl_handle);
+      if (direction == SND_PCM_STREAM_CAPTURE ? descriptor.is_input() : descriptor.is_output())
+        return descriptor;
+    }
 
-  thread _processing_thread;
-  atomic<bool> _running = false;
+    return nullopt;
+  }
 
-  string _name = {};
-  __alsa_stream_config _config;
+  inline static constexpr auto _probe_timeout = chrono::milliseconds(500);
 
-  using __coreaudio_callback_t = function<void(audio_device&, audio_device_io<__coreaudio_native_sample_type>&)>;
-  __coreaudio_callback_t _user_callback;
-  audio_device_io<__coreaudio_native_sample_type> _current_buffers;
-};
+  mutex _cards_mutex;
+  bool _keep_cards = false;
+  map<int, vector<__device_entry>> _cards;
 
-class audio_device_list : public forward_list<audio_device> {
-};
+  static bool _is_input(const audio_device_descriptor& d) {
+    return d.is_input();
+  }
 
-class __audio_device_enumerator {
-public:
-  static __audio_device_enumerator& get_instance() {
-    static __audio_device_enumerator cde;
-    return cde;
+  static bool _is_output(const audio_device_descriptor& d) {
+    return d.is_output();
   }
 
-  optional<audio_device> get_default_io_device(snd_pcm_stream_t direction) {
+  // Takes the control handle the caller already holds for the card, so
+  // naming the device does not open it again.
+  static audio_device_descriptor get_descriptor(__alsa_audio_device_id device_id, audio_device_io_mode io_mode,
+                                                __snd_ctl_t_raai& snd_ctl_handle) {
+    string name = device_id.get_device_name(snd_ctl_handle);
+    auto config = get_stream_configs(snd_ctl_handle, {device_id}).front();
 
-    //TODO ignoring direction
-    auto device_ids = get_device_ids();
+    return {device_id, move(name), config, io_mode};
+  }
 
-    void ** name_hints_raw = {nullptr};
-    snd_device_name_hint(-1, "pcm", &name_hints_raw);
-    __snd_device_name_hint_raai nameHints(name_hints_raw);
+  // The channel counts of both directions of the card's devices. Most
+  // drivers offer channel maps, which take no PCM open; the widest one
+  // audio_buffer can hold is used. A direction the control device does not
+  // list is missing. The channel range of the others comes from their
+  // capabilities, probed concurrently through the pool and kept in the
+  // capability cache, so a warm start opens no PCM and a stalled one costs
+  // at most the probe timeout. A direction that cannot be probed, or opens
+  // with more channels than audio_buffer holds, is left out.
+  static vector<__alsa_stream_config> get_stream_configs(__snd_ctl_t_raai& snd_ctl_handle,
+                                                         const vector<__alsa_audio_device_id>& device_ids) {
+    vector<__alsa_stream_config> configs(device_ids.size());
+    vector<__alsa_probe_pool::job_t> jobs;
+    vector<int*> probed_channels;
+
+    for (size_t i = 0; i < device_ids.size(); ++i) {
+      for (auto direction : {SND_PCM_STREAM_CAPTURE, SND_PCM_STREAM_PLAYBACK}) {
+        int& channels = direction == SND_PCM_STREAM_CAPTURE ? configs[i].input_config : configs[i].output_config;
+
+        __snd_pcm_info_t_raai pcm_info = device_ids[i].get_pcm_info(direction);
+        if (!pcm_info || snd_ctl_pcm_info(snd_ctl_handle.get(), pcm_info.get()) < 0)
+          continue;
 
-    for (void** name_hint_itr = name_hints_raw; *name_hint_itr; ++name_hint_itr) {
-      std::unique_ptr<char> name_raai(snd_device_name_get_hint(*name_hint_itr, "NAME"));
-      std::unique_ptr<char> desc_raai(snd_device_name_get_hint(*name_hint_itr, "DESC"));
-
-      std::string name(name_raai.get());
-      std::string desc(desc_raai.get());
-      desc = desc.substr(0, desc.find('\n'));
-      if (name.rfind("sysdefault:CARD=", 0) == 0) {
-        auto device_id_iterator = find_if(begin(device_ids), end(device_ids), [desc](const auto& device_id){
-          return device_id.get_device_name() == desc;
-        });
-        if (device_id_iterator != end(device_ids)) {
-          return get_device(*device_id_iterator);
+        if (auto chmap_channels = get_chmap_channels(device_ids[i], direction)) {
+          channels = *chmap_channels;
+        } else {
+          jobs.emplace_back(device_ids[i], direction);
+          probed_channels.push_back(&channels);
         }
       }
     }
-    return nullopt;
-  }
 
-  template <typename Condition>
-  auto get_device_list(Condition condition) {
-    audio_device_list devices;
-    const auto device_ids = get_device_ids();
+    if (!jobs.empty()) {
+      auto capabilities = __alsa_probe_pool::get_instance().probe(move(jobs), _probe_timeout);
+      for (size_t i = 0; i < capabilities.size(); ++i)
+        *probed_channels[i] = usable_channels(capabilities[i]->min_channels, capabilities[i]->max_channels);
+    }
+
+    return configs;
+  }
 
-    for (const auto device_id : device_ids) {
-      auto device_from_id = get_device(device_id);
-      if (condition(device_from_id))
-        devices.push_front(move(device_from_id));
+  // The widest channel map audio_buffer can hold, zero if none fits, or
+  // nothing when the driver has no channel maps.
+  static optional<int> get_chmap_channels(const __alsa_audio_device_id& device_id, snd_pcm_stream_t direction) {
+    __snd_pcm_chmap_query_raai chmap_query(snd_pcm_query_chmaps_from_hw(device_id.card_id, device_id.device_id, 0, direction));
+    if (!chmap_query)
+      return nullopt;
+
+    unsigned int max_channels = 0;
+    for (auto** chmap_iterator = chmap_query.get(); *chmap_iterator != nullptr; ++chmap_iterator) {
+      const unsigned int channels = (*chmap_iterator)->map.channels;
+      if (channels <= __audio_buffer_max_num_channels)
+        max_channels = max(max_channels, channels);
     }
 
-    return devices;
+    return static_cast<int>(max_channels);
   }
 
-  auto get_input_device_list() {
-    return get_device_list([](const audio_device& d){
-      return d.is_input();
-    });
+  // Beyond what audio_buffer holds, the first channels are used, as long as
+  // the device can open with that few.
+  static int usable_channels(unsigned int min_channels, unsigned int max_channels) noexcept {
+    if (max_channels == 0 || min_channels > __audio_buffer_max_num_channels)
+      return 0;
+
+    return static_cast<int>(min<size_t>(max_channels, __audio_buffer_max_num_channels));
   }
 
-  auto get_output_device_list() {
-    return get_device_list([](const audio_device& d){
-      return d.is_output();
-    });
+  // Zero channels when the direction is missing.
+  static pair<unsigned int, unsigned int> get_hw_channel_range(const __alsa_audio_device_id& device_id, snd_pcm_stream_t direction) {
+    // a missing direction is not an error here, so no check_error
+    snd_pcm_t* pcm_raw = nullptr;
+    if (snd_pcm_open(&pcm_raw, device_id.get_device_id_str().c_str(), direction, SND_PCM_NONBLOCK) < 0 || !pcm_raw)
+      return {0, 0};
+
+    __snd_pcm_t_raai pcm(pcm_raw);
+    __snd_pcm_hw_params_raai hw_params = device_id.get_hw_params();
+
+    unsigned int min_channels = 0;
+    unsigned int max_channels = 0;
+    if (!hw_params
+        || snd_pcm_hw_params_any(pcm.get(), hw_params.get()) < 0
+        || snd_pcm_hw_params_get_channels_min(hw_params.get(), &min_channels) < 0
+        || snd_pcm_hw_params_get_channels_max(hw_params.get(), &max_channels) < 0)
+      return {0, 0};
+
+    return {min_channels, max_channels};
   }
+};
 
-private:
-  __audio_device_enumerator() = default;
+// Runs the callbacks registered through set_audio_device_list_callback.
+// A thread watches the device directory with inotify and reacts to control
+// devices (controlC<card>) appearing, disappearing or changing permissions,
+// which is how udev announces a card being plugged in or removed. Only
+// that card is read again. The directory is /dev/snd unless set otherwise,
+// e.g. to a scratch directory in tests.
+//
+// The callbacks run on the monitor thread. A single hotplug may invoke the
+// device list callback more than once.
+class __alsa_device_list_monitor {
+public:
+  static __alsa_device_list_monitor& get_instance() {
+    static __alsa_device_list_monitor monitor;
+    return monitor;
+  }
 
-  static vector<__alsa_audio_device_id> get_device_ids() {
+  ~__alsa_device_list_monitor() {
+    _stop();
+  }
 
-    vector<__alsa_audio_device_id> device_ids;
+  void register_callback(audio_device_list_event event, function<void()> callback) {
+    {
+      lock_guard<mutex> lock(_callbacks_mutex);
+      _callbacks[event] = move(callback);
+    }
 
-    __alsa_audio_device_id device_id;
-    while (true) {
+    lock_guard<mutex> lock(_thread_mutex);
+    if (!_thread.joinable())
+      _start();
+  }
 
-      int result = snd_card_next(&device_id.card_id);
-      if (result < 0 || device_id.card_id < 0)
-        break;
+  void set_directory(string directory) {
+    lock_guard<mutex> lock(_thread_mutex);
+    _directory = move(directory);
+    if (_thread.joinable()) {
+      _stop();
+      _start();
+    }
+  }
 
-      __snd_ctl_t_raai snd_ctl_handle = device_id.card_handle();
-      if (!snd_ctl_handle)
-        continue;
+private:
+  __alsa_device_list_monitor() = default;
 
-      while (true) {
-        result = snd_ctl_pcm_next_device(snd_ctl_handle.get(), &device_id.device_id);
-        if (result < 0 || device_id.device_id < 0)
-          break;
+  void _start() {
+    _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_inotify_fd < 0)
+      return;
 
-        device_ids.push_back(device_id);
-      }
+    if (inotify_add_watch(_inotify_fd, _directory.c_str(), IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+      close(_inotify_fd);
+      _inotify_fd = -1;
+      return;
+    }
+
+    _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wake_fd < 0) {
+      close(_inotify_fd);
+      _inotify_fd = -1;
+      return;
     }
 
-    return device_ids;
+    __audio_device_enumerator::get_instance().keep_cards();
+    _default_card_ids = _read_default_card_ids();
+    _thread = thread(&__alsa_device_list_monitor::run_thread, this, _inotify_fd, _wake_fd);
   }
 
-  static audio_device get_device(__alsa_audio_device_id device_id) {
-    string name = get_device_name(device_id);
-    auto config = get_device_io_stream_config(device_id);
+  void _stop() {
+    if (_thread.joinable()) {
+      const uint64_t value = 1;
+      [[maybe_unused]] auto written = write(_wake_fd, &value, sizeof(value));
+      _thread.join();
+    }
 
-    return {device_id, move(name), config};
+    for (int* fd : {&_inotify_fd, &_wake_fd}) {
+      if (*fd >= 0)
+        close(*fd);
+      *fd = -1;
+    }
   }
 
-  static string get_device_name(__alsa_audio_device_id device_id) {
-    return device_id.get_device_name();
-  }
+  void run_thread(int inotify_fd, int wake_fd) {
+    alignas(inotify_event) char buffer[4096];
+    pollfd fds[] = {{inotify_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
 
-  static __alsa_stream_config get_device_io_stream_config(__alsa_audio_device_id device_id) {
-    return {
-      get_device_stream_config(device_id, SND_PCM_STREAM_CAPTURE),
-      get_device_stream_config(device_id, SND_PCM_STREAM_PLAYBACK)
-    };
-  }
+    while (true) {
+      if (poll(fds, 2, -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        return;
+      }
 
-  static int get_device_stream_config(__alsa_audio_device_id device_id, snd_pcm_stream_t streamDirection) {
+      if (fds[1].revents != 0)
+        return;
 
-    __snd_pcm_chmap_query_raai chmap_query(snd_pcm_query_chmaps_from_hw(device_id.card_id, device_id.device_id, 0, streamDirection));
+      const ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+      if (length <= 0)
+        continue;
 
-    if (!chmap_query) {
-      return 0;
-    }
+      vector<int> changed_cards;
+      for (ssize_t offset = 0; offset < length; ) {
+        const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+        offset += sizeof(inotify_event) + event->len;
 
-    // TODO do better than just matching 2 or 1 channels
-    auto find_chmap = [&chmap_query](int count) -> bool  {
-      auto ** chmap_iterator = chmap_query.get();
-      while (*chmap_iterator != nullptr) {
-        if ((*chmap_iterator)->map.channels == count)
-          return true;
-        ++chmap_iterator;
+        const int card_id = event->len > 0 ? _card_from_name(event->name) : -1;
+        if (card_id >= 0 && find(begin(changed_cards), end(changed_cards), card_id) == end(changed_cards))
+          changed_cards.push_back(card_id);
       }
-      return false;
-    };
 
-    if (find_chmap(2)) {
-      return 2;
+      if (changed_cards.empty())
+        continue;
+
+      for (int card_id : changed_cards)
+        __audio_device_enumerator::get_instance().refresh_card(card_id);
+
+      _notify(audio_device_list_event::device_list_changed);
+
+      const auto default_card_ids = _read_default_card_ids();
+      if (default_card_ids.first != _default_card_ids.first)
+        _notify(audio_device_list_event::default_input_device_changed);
+      if (default_card_ids.second != _default_card_ids.second)
+        _notify(audio_device_list_event::default_output_device_changed);
+      _default_card_ids = default_card_ids;
     }
+  }
 
-    if (find_chmap(1)) {
-      return 1;
+  void _notify(audio_device_list_event event) {
+    function<void()> callback;
+    {
+      lock_guard<mutex> lock(_callbacks_mutex);
+      auto callback_iter = _callbacks.find(event);
+      if (callback_iter == _callbacks.end())
+        return;
+      callback = callback_iter->second;
     }
 
-    return 0;
+    invoke(callback);
+  }
+
+  // capture, playback
+  static pair<int, int> _read_default_card_ids() {
+    return {__audio_device_enumerator::get_default_card_id(SND_PCM_STREAM_CAPTURE),
+            __audio_device_enumerator::get_default_card_id(SND_PCM_STREAM_PLAYBACK)};
+  }
+
+  static int _card_from_name(string_view name) {
+    constexpr string_view prefix = "controlC";
+    if (name.substr(0, prefix.size()) != prefix)
+      return -1;
+
+    name.remove_prefix(prefix.size());
+    int card_id = -1;
+    auto [end, error] = from_chars(name.data(), name.data() + name.size(), card_id);
+    if (error != errc() || end != name.data() + name.size())
+      return -1;
+
+    return card_id;
   }
+
+  // the callbacks run on the monitor thread, which _stop joins with
+  // _thread_mutex held, so they only ever take _callbacks_mutex
+  mutex _callbacks_mutex;
+  map<audio_device_list_event, function<void()>> _callbacks;
+  mutex _thread_mutex;
+  string _directory = "/dev/snd";
+  thread _thread;
+  int _inotify_fd = -1;
+  int _wake_fd = -1;
+  pair<int, int> _default_card_ids = {-1, -1};
 };
 
 optional<audio_device> get_default_audio_input_device() {
@@ -1093,73 +5023,39 @@ audio_device_list get_audio_input_device_list() {
 audio_device_list get_audio_output_device_list() {
   return __audio_device_enumerator::get_instance().get_output_device_list();
 }
- /*
-struct __coreaudio_device_config_listener {
-  static void register_callback(audio_device_list_event event, function<void()> cb) {
-    static __coreaudio_device_config_listener dcl;
-    const auto selector = get_coreaudio_selector(event);
-    dcl.callbacks[selector] = move(cb);
-  }
-
-private:
-  map<AudioObjectPropertySelector, function<void()>> callbacks;
 
-  __coreaudio_device_config_listener() {
-    coreaudio_add_internal_callback<kAudioHardwarePropertyDevices>();
-    coreaudio_add_internal_callback<kAudioHardwarePropertyDefaultInputDevice>();
-    coreaudio_add_internal_callback<kAudioHardwarePropertyDefaultOutputDevice>();
-  }
-
-  template <AudioObjectPropertySelector selector>
-  void coreaudio_add_internal_callback() {
-    AudioObjectPropertyAddress pa = {
-        selector,
-        kAudioObjectPropertyScopeGlobal,
-        kAudioObjectPropertyElementMaster
-    };
+// Opens a PCM by its ALSA name, e.g. "default", "dmix", "null" or a file
+// plugin, rather than a card's hardware device. nullopt when ALSA cannot
+// open it in that direction.
+inline optional<audio_device> get_alsa_input_device(string pcm_name) {
+  return __audio_device_enumerator::get_instance().get_named_io_device(move(pcm_name), SND_PCM_STREAM_CAPTURE);
+}
 
-    if (!__coreaudio_util::check_error(AudioObjectAddPropertyListener(
-        kAudioObjectSystemObject, &pa, &coreaudio_internal_callback<selector>, this))) {
-      assert(false); // failed to register device config listener!
-    }
-  }
+inline optional<audio_device> get_alsa_output_device(string pcm_name) {
+  return __audio_device_enumerator::get_instance().get_named_io_device(move(pcm_name), SND_PCM_STREAM_PLAYBACK);
+}
 
-  template <AudioObjectPropertySelector selector>
-  static OSStatus coreaudio_internal_callback(AudioObjectID device_id,
-                                              UInt32 &* inNumberAddresses *&,
-                                              const AudioObjectPropertyAddress* &* inAddresses *&,
-                                              void* void_ptr_to_this_listener) {
-    __coreaudio_device_config_listener& this_listener = *reinterpret_cast<__coreaudio_device_config_listener*>(void_ptr_to_this_listener);
-    this_listener.call<selector>();
-    return {};
-  }
+inline audio_device_descriptor_list get_audio_input_device_descriptors() {
+  return __audio_device_enumerator::get_instance().get_input_descriptor_list();
+}
 
-  template <AudioObjectPropertySelector selector>
-  void call() {
-    if (auto cb_iter = callbacks.find(selector); cb_iter != callbacks.end()) {
-      invoke(cb_iter->second);
-    }
-  }
+inline audio_device_descriptor_list get_audio_output_device_descriptors() {
+  return __audio_device_enumerator::get_instance().get_output_descriptor_list();
+}
 
-  static constexpr AudioObjectPropertySelector get_coreaudio_selector(audio_device_list_event event) noexcept {
-    switch (event) {
-      case audio_device_list_event::device_list_changed:
-        return kAudioHardwarePropertyDevices;
-      case audio_device_list_event::default_input_device_changed:
-        return kAudioHardwarePropertyDefaultInputDevice;
-      case audio_device_list_event::default_output_device_changed:
-        return kAudioHardwarePropertyDefaultOutputDevice;
-      default:
-        assert(false); // invalid event!
-        return {};
-    }
-  }*/
-//};
+// The directory watched for cards coming and going, /dev/snd by default.
+inline void set_audio_device_list_directory(string directory) {
+  __alsa_device_list_monitor::get_instance().set_directory(move(directory));
+}
 
-/*
-template <typename F, typename &* = enable_if_t<is_nothrow_invocable_v<F>> *&>
-void set_audio_device_list_callback(audio_device_list_event event, F&& cb) {
-  __coreaudio_device_config_listener::register_callback(event, function<void()>(cb));
+// Keeps probed device capabilities in the given file between runs. An
+// empty path turns the cache off, which is the default.
+inline void set_audio_device_capability_cache_file(string path) {
+  __alsa_capability_cache::get_instance().set_file(move(path));
 }
-*/
+template <typename F, typename /* = enable_if_t<is_invocable_v<F>> */>
+void set_audio_device_list_callback(audio_device_list_event event, F&& callback) {
+  __alsa_device_list_monitor::get_instance().register_callback(event, function<void()>(forward<F>(callback)));
+}
+
 _LIBSTDAUDIO_NAMESPACE_END
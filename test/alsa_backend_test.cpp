@@ -0,0 +1,857 @@
+// libstdaudio
+// Copyright (c) 2019 - Conrad Jones
+// Distributed under the Boost Software License, Version 1.0.
+// (See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
+
+// Tests of the parts of the ALSA backend that need no sound hardware.
+
+#include <audio>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <thread>
+#include "catch/catch.hpp"
+
+#if defined(__linux__)
+
+using namespace std::experimental;
+
+TEST_CASE("The event ring refuses pushes when full and pops in order")
+{
+  __alsa_spsc_ring<int, 4> ring;
+  int value = 0;
+
+  CHECK_FALSE(ring.pop(value));
+
+  for (int i = 0; i < 4; ++i)
+    CHECK(ring.push(i));
+  CHECK_FALSE(ring.push(4));
+
+  for (int i = 0; i < 4; ++i) {
+    REQUIRE(ring.pop(value));
+    CHECK(value == i);
+  }
+  CHECK_FALSE(ring.pop(value));
+}
+
+TEST_CASE("The event ring keeps its order across the wrap")
+{
+  __alsa_spsc_ring<int, 4> ring;
+  int next_pushed = 0;
+  int next_popped = 0;
+  int value = 0;
+
+  // three at a time through four slots: the indices wrap the storage often
+  for (int round = 0; round < 100; ++round) {
+    for (int i = 0; i < 3; ++i)
+      CHECK(ring.push(next_pushed++));
+    for (int i = 0; i < 3; ++i) {
+      REQUIRE(ring.pop(value));
+      CHECK(value == next_popped++);
+    }
+  }
+  CHECK_FALSE(ring.pop(value));
+}
+
+TEST_CASE("The event ring hands every value from one thread to another")
+{
+  constexpr int num_values = 100'000;
+  __alsa_spsc_ring<int, 64> ring;
+
+  std::thread producer([&ring] {
+    for (int i = 0; i < num_values; ++i) {
+      while (!ring.push(i))
+        std::this_thread::yield();
+    }
+  });
+
+  int expected = 0;
+  int value = 0;
+  while (expected < num_values) {
+    if (ring.pop(value)) {
+      REQUIRE(value == expected);
+      ++expected;
+    }
+  }
+  producer.join();
+  CHECK_FALSE(ring.pop(value));
+}
+
+namespace {
+  // counts the live copies of a callback, to catch leaked or doubly
+  // destroyed captures
+  struct tracked_capture {
+    int* live;
+
+    explicit tracked_capture(int* live) noexcept : live(live) { ++*live; }
+    tracked_capture(tracked_capture&& other) noexcept : live(other.live) { ++*live; }
+    tracked_capture(const tracked_capture& other) noexcept : live(other.live) { ++*live; }
+    ~tracked_capture() { --*live; }
+  };
+}
+
+TEST_CASE("An inline callback calls the stored callable")
+{
+  int sum = 0;
+  __alsa_inline_callback<int(int)> callback = [&sum](int value) noexcept { return sum += value; };
+
+  REQUIRE(static_cast<bool>(callback));
+  CHECK(callback(2) == 2);
+  CHECK(callback(3) == 5);
+  CHECK_FALSE(static_cast<bool>(__alsa_inline_callback<int(int)>()));
+}
+
+TEST_CASE("An inline callback moves its capture and destroys it once")
+{
+  int live = 0;
+  {
+    __alsa_inline_callback<int()> first = [capture = tracked_capture(&live)]() noexcept { return *capture.live; };
+    CHECK(live == 1);
+
+    __alsa_inline_callback<int()> second = std::move(first);
+    CHECK(live == 1);
+    CHECK_FALSE(static_cast<bool>(first));
+    REQUIRE(static_cast<bool>(second));
+    CHECK(second() == 1);
+
+    // assigning over a callback destroys the capture it held
+    int other_live = 0;
+    __alsa_inline_callback<int()> third = [capture = tracked_capture(&other_live)]() noexcept { return capture.live == nullptr ? -1 : 0; };
+    CHECK(other_live == 1);
+    third = std::move(second);
+    CHECK(other_live == 0);
+    CHECK(live == 1);
+    CHECK(third() == 1);
+
+    // moving an empty callback leaves the target empty
+    third = std::move(first);
+    CHECK(live == 0);
+    CHECK_FALSE(static_cast<bool>(third));
+  }
+  CHECK(live == 0);
+}
+
+TEST_CASE("An inline callback only takes captures that fit its storage")
+{
+  using callback_t = __alsa_inline_callback<void(), 32>;
+
+  std::array<char, 32> small = {};
+  std::array<char, 33> large = {};
+  auto small_callback = [small]() noexcept { (void)small; };
+  auto large_callback = [large]() noexcept { (void)large; };
+
+  // a large callback is a compile error (static_assert) rather than an
+  // allocation, as checked through the same trait
+  static_assert(callback_t::fits<decltype(small_callback)>);
+  static_assert(!callback_t::fits<decltype(large_callback)>);
+
+  callback_t callback = small_callback;
+  CHECK(static_cast<bool>(callback));
+}
+
+namespace {
+  // Full scale, out of range and NaN samples, then a ramp, with a length
+  // that leaves a scalar tail after the vectorised part.
+  std::vector<float> make_float_samples() {
+    std::vector<float> samples = {0.0f, 0.5f, -0.5f, 1.0f, -1.0f, 1.5f, -1.5f,
+                                  std::numeric_limits<float>::infinity(),
+                                  -std::numeric_limits<float>::infinity(),
+                                  std::numeric_limits<float>::quiet_NaN(),
+                                  0x1.fffffep-1f, -0x1.fffffep-1f};
+    for (int i = 0; i < 45; ++i)
+      samples.push_back(-1.1f + 0.05f * static_cast<float>(i));
+    return samples;
+  }
+
+  template <typename _From, typename _To>
+  void check_matches_scalar(const std::vector<_From>& input) {
+    std::vector<_To> converted(input.size());
+    __alsa_sample_converter::convert(input.data(), converted.data(), input.size());
+
+    for (size_t i = 0; i < input.size(); ++i) {
+      INFO("sample " << i);
+      CHECK(converted[i] == (__alsa_sample_converter::convert_sample<_From, _To>(input[i])));
+    }
+  }
+
+  template <typename _SampleType>
+  std::vector<_SampleType> make_integer_samples() {
+    std::vector<_SampleType> samples = {0, 1, -1, std::numeric_limits<_SampleType>::max(), std::numeric_limits<_SampleType>::min()};
+    for (int i = 0; i < 45; ++i)
+      samples.push_back(static_cast<_SampleType>(std::numeric_limits<_SampleType>::min() / 45 * (i - 22)));
+    return samples;
+  }
+}
+
+TEST_CASE("Vectorised sample conversion matches the scalar conversion")
+{
+  const auto floats = make_float_samples();
+  check_matches_scalar<float, int16_t>(floats);
+  check_matches_scalar<float, int32_t>(floats);
+
+  check_matches_scalar<int16_t, float>(make_integer_samples<int16_t>());
+  check_matches_scalar<int32_t, float>(make_integer_samples<int32_t>());
+  check_matches_scalar<int16_t, int32_t>(make_integer_samples<int16_t>());
+  check_matches_scalar<int32_t, int16_t>(make_integer_samples<int32_t>());
+}
+
+TEST_CASE("Float samples are clamped to full scale on conversion to integers")
+{
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const float infinity = std::numeric_limits<float>::infinity();
+
+  // 8 samples, so that the SSE2 path converts all of them
+  const std::vector<float> input = {1.0f, -1.0f, 2.0f, -2.0f, infinity, -infinity, nan, 0.0f};
+
+  std::vector<int16_t> narrow(input.size());
+  __alsa_sample_converter::convert(input.data(), narrow.data(), input.size());
+  CHECK(narrow == std::vector<int16_t>{32767, -32768, 32767, -32768, 32767, -32768, -32768, 0});
+
+  std::vector<int32_t> wide(input.size());
+  __alsa_sample_converter::convert(input.data(), wide.data(), input.size());
+  const int32_t wide_max = 2147483520;  // 0x1.fffffep-1 * 2^31, the largest product below 2^31
+  CHECK(wide == std::vector<int32_t>{wide_max, INT32_MIN, wide_max, INT32_MIN, wide_max, INT32_MIN, INT32_MIN, 0});
+
+  CHECK((__alsa_sample_converter::convert_sample<float, int16_t>(nan)) == -32768);
+  CHECK((__alsa_sample_converter::convert_sample<float, int32_t>(nan)) == INT32_MIN);
+}
+
+TEST_CASE("Stats recorder aggregates callbacks and wakeups")
+{
+  __alsa_stats_recorder recorder;
+  const auto start = audio_clock_t::now();
+  const auto ms = std::chrono::milliseconds(1);
+
+  // 48 frames at 48 kHz last 1 ms
+  recorder.record_wakeup(start);
+  recorder.record_callback(start + ms, start + 2 * ms, 48, 48000);
+  recorder.record_callback(start + 2 * ms, start + 5 * ms, 48, 48000);
+  recorder.record_wakeup_delay(std::chrono::nanoseconds(100));
+  recorder.record_wakeup_delay(std::chrono::nanoseconds(300));
+
+  const auto stats = recorder.snapshot();
+  CHECK(stats.callbacks == 2);
+  CHECK(stats.frames_processed == 96);
+  CHECK(stats.wakeups == 1);
+  CHECK(stats.min_callback_duration == ms);
+  CHECK(stats.max_callback_duration == 3 * ms);
+  CHECK(stats.average_callback_duration == 2 * ms);
+  CHECK(stats.average_dsp_load == Approx(2.0));
+  CHECK(stats.max_dsp_load == Approx(3.0));
+  // only the first callback after a wakeup is timed against it
+  CHECK(stats.average_wakeup_latency == ms);
+  CHECK(stats.max_wakeup_latency == ms);
+  CHECK(stats.average_wakeup_delay.count() == 200);
+  CHECK(stats.max_wakeup_delay.count() == 300);
+  CHECK(stats.wakeup_jitter.count() == 100);
+}
+
+TEST_CASE("Stats recorder publishes system calls with the next update")
+{
+  __alsa_stats_recorder recorder;
+  recorder.count_system_calls(3);
+  CHECK(recorder.snapshot().system_calls == 0);
+
+  recorder.record_xrun();
+  CHECK(recorder.snapshot().system_calls == 3);
+}
+
+TEST_CASE("Stats recorder reset clears the counters but keeps the time to first frame")
+{
+  __alsa_stats_recorder recorder;
+  const auto start = audio_clock_t::now();
+  recorder.record_first_frame(std::chrono::milliseconds(5));
+  recorder.record_xrun();
+  recorder.record_rewind(64);
+  recorder.record_callback(start, start + std::chrono::microseconds(10), 32, 48000);
+
+  recorder.reset();
+  const auto stats = recorder.snapshot();
+  CHECK(stats.xruns == 0);
+  CHECK(stats.rewinds == 0);
+  CHECK(stats.frames_rewound == 0);
+  CHECK(stats.callbacks == 0);
+  CHECK(stats.frames_processed == 0);
+  CHECK(stats.max_callback_duration.count() == 0);
+  CHECK(stats.max_dsp_load == 0);
+  CHECK(stats.time_to_first_frame == std::chrono::milliseconds(5));
+}
+
+TEST_CASE("Stats recorder carries out a requested reset on the next update")
+{
+  __alsa_stats_recorder recorder;
+  recorder.record_xrun();
+  recorder.record_xrun();
+
+  recorder.request_reset();
+  CHECK(recorder.snapshot().xruns == 2);
+
+  recorder.record_suspend();
+  const auto stats = recorder.snapshot();
+  CHECK(stats.xruns == 0);
+  CHECK(stats.suspends == 1);
+}
+
+TEST_CASE("Stats snapshots taken while the recorder updates are consistent")
+{
+  __alsa_stats_recorder recorder;
+  constexpr uint64_t num_callbacks = 200000;
+  constexpr uint64_t frames_per_callback = 3;
+  std::atomic<bool> done = false;
+
+  std::thread writer([&] {
+    const auto now = audio_clock_t::now();
+    for (uint64_t i = 0; i < num_callbacks; ++i) {
+      recorder.record_callback(now, now, frames_per_callback, 48000);
+      if (i % 1000 == 0)
+        recorder.request_reset();
+    }
+    done = true;
+  });
+
+  // callbacks and frames_processed change in the same update, so a torn
+  // snapshot would show them out of step
+  uint64_t inconsistent = 0;
+  uint64_t snapshots = 0;
+  while (!done) {
+    const auto stats = recorder.snapshot();
+    if (stats.frames_processed != stats.callbacks * frames_per_callback)
+      ++inconsistent;
+    ++snapshots;
+  }
+  writer.join();
+
+  CHECK(snapshots > 0);
+  CHECK(inconsistent == 0);
+  CHECK(recorder.snapshot().frames_processed == recorder.snapshot().callbacks * frames_per_callback);
+}
+
+namespace {
+  __alsa_capability_cache::capabilities_ptr make_capabilities(unsigned int max_sample_rate) {
+    auto capabilities = std::make_shared<__alsa_device_capabilities>();
+    capabilities->known = true;
+    capabilities->sample_rates = {44100, 48000};
+    capabilities->min_sample_rate = 8000;
+    capabilities->max_sample_rate = max_sample_rate;
+    capabilities->audio_formats = {SND_PCM_FORMAT_S16_LE, SND_PCM_FORMAT_S32_LE};
+    capabilities->min_buffer_size = 64;
+    capabilities->max_buffer_size = 65536;
+    capabilities->default_buffer_size = 16384;
+    capabilities->min_channels = 2;
+    capabilities->max_channels = 8;
+    return capabilities;
+  }
+
+  const std::string playback_key = "PCH\tHDA Intel PCH\tHDA-Intel\t0\tplayback";
+  const std::string capture_key = "PCH\tHDA Intel PCH\tHDA-Intel\t0\tcapture";
+}
+
+TEST_CASE("Capability cache contents survive a round trip")
+{
+  __alsa_capability_cache::entries_t entries;
+  entries[playback_key] = make_capabilities(192000);
+  entries[capture_key] = make_capabilities(96000);
+
+  const auto parsed = __alsa_capability_cache::parse(__alsa_capability_cache::serialize(entries));
+  REQUIRE(parsed.size() == 2);
+
+  for (const auto& [key, capabilities] : entries) {
+    INFO(key);
+    REQUIRE(parsed.count(key) == 1);
+    const auto& loaded = *parsed.at(key);
+    CHECK(loaded.known);
+    CHECK(loaded.sample_rates == capabilities->sample_rates);
+    CHECK(loaded.min_sample_rate == capabilities->min_sample_rate);
+    CHECK(loaded.max_sample_rate == capabilities->max_sample_rate);
+    CHECK(loaded.audio_formats == capabilities->audio_formats);
+    CHECK(loaded.min_buffer_size == capabilities->min_buffer_size);
+    CHECK(loaded.max_buffer_size == capabilities->max_buffer_size);
+    CHECK(loaded.default_buffer_size == capabilities->default_buffer_size);
+    CHECK(loaded.min_channels == capabilities->min_channels);
+    CHECK(loaded.max_channels == capabilities->max_channels);
+  }
+}
+
+TEST_CASE("Capability cache contents from another version are ignored")
+{
+  __alsa_capability_cache::entries_t entries;
+  entries[playback_key] = make_capabilities(192000);
+  std::string contents = __alsa_capability_cache::serialize(entries);
+
+  CHECK(__alsa_capability_cache::parse("").empty());
+
+  const std::string old_version = "libstdaudio alsa capabilities 2" + contents.substr(contents.find('\n'));
+  CHECK(__alsa_capability_cache::parse(old_version).empty());
+}
+
+TEST_CASE("Damaged capability cache lines are skipped")
+{
+  __alsa_capability_cache::entries_t entries;
+  entries[playback_key] = make_capabilities(192000);
+  const std::string contents = __alsa_capability_cache::serialize(entries);
+  const std::string header = contents.substr(0, contents.find('\n') + 1);
+  const std::string good_line = contents.substr(header.size());
+
+  SECTION("a well-formed line, for comparison") {
+    const std::string line = capture_key + "\t64\t65536\t16384\t8000\t48000\t2\t8\t48000\t2\n";
+    CHECK(__alsa_capability_cache::parse(header + line + good_line).size() == 2);
+  }
+
+  SECTION("a line with a field missing") {
+    const std::string line = capture_key + "\t64\t65536\t16384\t8000\t48000\t2\t8\t48000\n";
+    CHECK(__alsa_capability_cache::parse(header + line + good_line).size() == 1);
+  }
+
+  SECTION("a line with a field too many") {
+    const std::string line = capture_key + "\t64\t65536\t16384\t8000\t48000\t2\t8\t48000\t2\t0\n";
+    CHECK(__alsa_capability_cache::parse(header + line + good_line).size() == 1);
+  }
+
+  SECTION("a line with a value that is not a number") {
+    const std::string line = capture_key + "\t64\t65536\tlots\t8000\t48000\t2\t8\t48000\t2\n";
+    CHECK(__alsa_capability_cache::parse(header + line + good_line).size() == 1);
+  }
+
+  SECTION("a line with a number followed by garbage") {
+    const std::string line = capture_key + "\t64\t65536\t16384\t8000\t48000\t2\t8\t48000,44100x\t2\n";
+    CHECK(__alsa_capability_cache::parse(header + line + good_line).size() == 1);
+  }
+
+  SECTION("a file cut short in the middle of a line") {
+    entries[capture_key] = make_capabilities(96000);
+    std::string both = __alsa_capability_cache::serialize(entries);
+    // drop the sample formats and the newline of the last entry
+    both.resize(both.rfind('\t'));
+
+    const auto parsed = __alsa_capability_cache::parse(both);
+    CHECK(parsed.size() == 1);
+    CHECK(parsed.count(capture_key) == 1);
+  }
+}
+
+TEST_CASE("Timer scheduler watermark starts at a quarter of the buffer")
+{
+  __alsa_timer_scheduler scheduler;
+  scheduler.reset(1024);
+  CHECK(scheduler.watermark() == 256);
+
+  // never below one frame, even for tiny buffers
+  scheduler.reset(4);
+  CHECK(scheduler.watermark() == 1);
+}
+
+TEST_CASE("Timer scheduler watermark doubles on xruns up to half the buffer")
+{
+  __alsa_timer_scheduler scheduler;
+  scheduler.reset(1024);
+
+  scheduler.record_xrun();
+  CHECK(scheduler.watermark() == 512);
+  scheduler.record_xrun();
+  CHECK(scheduler.watermark() == 512);
+}
+
+TEST_CASE("Timer scheduler watermark shrinks after ten seconds without xruns")
+{
+  __alsa_timer_scheduler scheduler;
+  scheduler.reset(1024);
+  const auto start = audio_clock_t::now();
+
+  scheduler.sleep_time(1024, 48000, start + std::chrono::seconds(5));
+  CHECK(scheduler.watermark() == 256);
+
+  scheduler.sleep_time(1024, 48000, start + std::chrono::seconds(11));
+  CHECK(scheduler.watermark() == 224);
+
+  // down to a sixteenth of the buffer, and no further
+  for (int i = 2; i < 40; ++i)
+    scheduler.sleep_time(1024, 48000, start + std::chrono::seconds(11 * i));
+  CHECK(scheduler.watermark() == 64);
+}
+
+TEST_CASE("Timer scheduler sleeps until the headroom reaches the watermark")
+{
+  __alsa_timer_scheduler scheduler;
+  scheduler.reset(1024);
+  const auto now = audio_clock_t::now();
+
+  // 480 frames above the watermark of 256 last 10 ms at 48 kHz
+  CHECK(scheduler.sleep_time(736, 48000, now) == std::chrono::milliseconds(10));
+
+  // at or below the watermark, and without a rate, it sleeps the minimum
+  CHECK(scheduler.sleep_time(256, 48000, now) == std::chrono::microseconds(100));
+  CHECK(scheduler.sleep_time(0, 48000, now) == std::chrono::microseconds(100));
+  CHECK(scheduler.sleep_time(736, 0, now) == std::chrono::microseconds(100));
+
+  // a frame above the watermark is still the minimum
+  CHECK(scheduler.sleep_time(257, 48000, now) == std::chrono::microseconds(100));
+}
+
+namespace {
+  __alsa_pcm_stream make_stream(snd_pcm_stream_t direction) {
+    __alsa_pcm_stream stream;
+    stream.direction = direction;
+    stream.buffer_size = 1024;
+    stream.period_size = 256;
+    stream.period_count = 4;
+    return stream;
+  }
+}
+
+TEST_CASE("Playback is primed with whole periods within the buffer")
+{
+  const auto stream = make_stream(SND_PCM_STREAM_PLAYBACK);
+
+  // no periods asked for still primes one
+  CHECK(stream.prefill_frames(0, 0) == 256);
+  CHECK(stream.prefill_frames(1, 0) == 256);
+  CHECK(stream.prefill_frames(3, 0) == 768);
+  CHECK(stream.prefill_frames(4, 0) == 1024);
+  CHECK(stream.prefill_frames(10, 0) == 1024);
+}
+
+TEST_CASE("Playback with fixed blocks is primed with whole blocks within the buffer")
+{
+  const auto stream = make_stream(SND_PCM_STREAM_PLAYBACK);
+
+  CHECK(stream.prefill_frames(1, 96) == 288);
+  CHECK(stream.prefill_frames(2, 128) == 512);
+  // rounding up to whole blocks never overfills the buffer
+  CHECK(stream.prefill_frames(4, 96) == 1024);
+}
+
+TEST_CASE("The first frame is dated from the first timestamp after the pointer moved")
+{
+  const auto timestamp = audio_clock_t::now();
+
+  SECTION("playback") {
+    auto stream = make_stream(SND_PCM_STREAM_PLAYBACK);
+    stream.timestamp = timestamp;
+    stream.frames_transferred = 1024;
+
+    // a full ring has not started playing yet
+    stream.timestamp_avail = 0;
+    CHECK_FALSE(stream.first_frame_time(48000).has_value());
+
+    // 480 of the 1024 frames written have been played, 10 ms at 48 kHz
+    stream.timestamp_avail = 480;
+    REQUIRE(stream.first_frame_time(48000).has_value());
+    CHECK(*stream.first_frame_time(48000) == timestamp - std::chrono::milliseconds(10));
+  }
+
+  SECTION("capture") {
+    auto stream = make_stream(SND_PCM_STREAM_CAPTURE);
+    stream.timestamp = timestamp;
+
+    stream.timestamp_avail = 0;
+    CHECK_FALSE(stream.first_frame_time(48000).has_value());
+
+    // 960 frames read and 480 more available were captured over 30 ms
+    stream.frames_transferred = 960;
+    stream.timestamp_avail = 480;
+    REQUIRE(stream.first_frame_time(48000).has_value());
+    CHECK(*stream.first_frame_time(48000) == timestamp - std::chrono::milliseconds(30));
+  }
+
+  SECTION("without a sample rate") {
+    auto stream = make_stream(SND_PCM_STREAM_CAPTURE);
+    stream.timestamp_avail = 480;
+    CHECK_FALSE(stream.first_frame_time(0).has_value());
+  }
+}
+
+TEST_CASE("Spinning returns as soon as a period is ready")
+{
+  std::atomic<bool> running = true;
+  int checks = 0;
+  auto ready_on_third_check = [&checks] { return ++checks == 3; };
+
+  const auto deadline = audio_clock_t::now() + std::chrono::seconds(10);
+  CHECK(__alsa_thread_util::spin_until(ready_on_third_check, running, deadline));
+  CHECK(checks == 3);
+}
+
+TEST_CASE("Spinning wakes up for a period made ready by another thread")
+{
+  std::atomic<bool> running = true;
+  std::atomic<bool> period_ready = false;
+  audio_clock_t::time_point ready_time;
+
+  std::thread driver([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    ready_time = audio_clock_t::now();
+    period_ready = true;
+  });
+
+  const auto deadline = audio_clock_t::now() + std::chrono::seconds(10);
+  const bool woken = __alsa_thread_util::spin_until([&] { return period_ready.load(); }, running, deadline);
+  const auto wakeup_time = audio_clock_t::now();
+  driver.join();
+
+  CHECK(woken);
+  // a spinning thread sees the period without being scheduled in again
+  CHECK(wakeup_time - ready_time < std::chrono::milliseconds(100));
+}
+
+TEST_CASE("Spinning gives up once the budget is spent")
+{
+  std::atomic<bool> running = true;
+  int checks = 0;
+  auto never_ready = [&checks] { ++checks; return false; };
+
+  const auto start = audio_clock_t::now();
+  CHECK_FALSE(__alsa_thread_util::spin_until(never_ready, running, start + std::chrono::milliseconds(2)));
+  CHECK(audio_clock_t::now() - start >= std::chrono::milliseconds(2));
+  CHECK(checks > 0);
+
+  // without a budget the period is checked once
+  checks = 0;
+  CHECK_FALSE(__alsa_thread_util::spin_until(never_ready, running, audio_clock_t::now()));
+  CHECK(checks == 1);
+}
+
+TEST_CASE("Spinning stops when the device stops")
+{
+  std::atomic<bool> running = false;
+  int checks = 0;
+  auto never_ready = [&checks] { ++checks; return false; };
+
+  CHECK(__alsa_thread_util::spin_until(never_ready, running, audio_clock_t::now() + std::chrono::seconds(10)));
+  CHECK(checks == 0);
+}
+
+TEST_CASE("Pausing holds running streams that can pause and drops the others")
+{
+  auto stream = make_stream(SND_PCM_STREAM_PLAYBACK);
+
+  stream.can_pause = true;
+  CHECK(stream.pause_action(SND_PCM_STATE_RUNNING) == __alsa_pause_action::pause);
+
+  stream.can_pause = false;
+  CHECK(stream.pause_action(SND_PCM_STATE_RUNNING) == __alsa_pause_action::drop);
+
+  // a stream still being primed keeps what it has
+  CHECK(stream.pause_action(SND_PCM_STATE_PREPARED) == __alsa_pause_action::none);
+  CHECK(stream.pause_action(SND_PCM_STATE_SETUP) == __alsa_pause_action::none);
+}
+
+TEST_CASE("Resuming only primes what pausing did not keep")
+{
+  const auto stream = make_stream(SND_PCM_STREAM_PLAYBACK);
+  const snd_pcm_uframes_t prefill = stream.prefill_frames(2, 0);
+
+  // a dropped stream comes back empty and is primed in full
+  CHECK(stream.queued_frames(1024) == 0);
+
+  // one that kept 768 frames needs nothing more
+  CHECK(stream.queued_frames(256) == 768);
+  CHECK(stream.queued_frames(256) >= prefill);
+
+  // a ring reporting more room than it has holds nothing
+  CHECK(stream.queued_frames(4096) == 0);
+}
+
+TEST_CASE("A paused device can be moved and both objects destroyed")
+{
+  auto device = get_alsa_output_device("null");
+  if (!device) {
+    WARN("Skipping: the null PCM is not available");
+    return;
+  }
+
+  device->connect([](audio_device&, audio_device_io<float>&) noexcept {});
+  if (!device->start()) {
+    WARN("Skipping: the null PCM could not be started");
+    return;
+  }
+
+  REQUIRE(device->pause());
+
+  SECTION("by move construction") {
+    audio_device moved(std::move(*device));
+    CHECK(moved.is_paused());
+    CHECK_FALSE(device->is_paused());
+    CHECK_FALSE(device->is_running());
+
+    // the moved-to device carries on where the source left off
+    CHECK(moved.resume());
+    CHECK(moved.is_running());
+    CHECK(moved.stop());
+  }
+
+  SECTION("by move assignment") {
+    auto other = get_alsa_output_device("null");
+    REQUIRE(other);
+    *other = std::move(*device);
+    CHECK(other->is_paused());
+    CHECK_FALSE(device->is_paused());
+    CHECK_FALSE(device->is_running());
+
+    CHECK(other->resume());
+    CHECK(other->is_running());
+    CHECK(other->stop());
+  }
+}
+
+TEST_CASE("Processing threads run under their policy from the start")
+{
+  audio_thread_policy policy;
+  policy.scheduling = audio_thread_scheduling::other;
+  policy.cpu_affinity = {0};
+  policy.prefault_stack_size = 64 * 1024;
+
+  audio_thread_policy_status status;
+  bool pinned_on_entry = false;
+  auto processing_thread = __alsa_thread_util::start_thread(policy, status, [&pinned_on_entry] {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    pinned_on_entry = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0
+      && CPU_COUNT(&cpu_set) == 1 && CPU_ISSET(0, &cpu_set);
+  });
+  processing_thread.join();
+
+  CHECK(status.affinity_applied);
+  CHECK(status.stack_prefaulted);
+  CHECK(pinned_on_entry);
+}
+
+TEST_CASE("Stacks are only prefaulted within their size")
+{
+  CHECK_FALSE(__alsa_thread_util::prefault_stack(0));
+  CHECK(__alsa_thread_util::prefault_stack(16 * 1024));
+  CHECK_FALSE(__alsa_thread_util::prefault_stack(size_t(1) << 40));
+
+  audio_thread_policy policy;
+  policy.scheduling = audio_thread_scheduling::other;
+  policy.prefault_stack_size = size_t(1) << 40;
+
+  audio_thread_policy_status status;
+  __alsa_thread_util::start_thread(policy, status, [] {}).join();
+  CHECK_FALSE(status.stack_prefaulted);
+}
+
+TEST_CASE("Devices an engine drives are only stopped through the engine")
+{
+  auto device = get_alsa_output_device("null");
+  if (!device) {
+    WARN("Skipping: the null PCM is not available");
+    return;
+  }
+
+  audio_device_engine<float> engine;
+  engine.add_device(*device);
+  engine.connect([](audio_device_engine<float>&, audio_device_engine<float>::io_list_t&) noexcept {});
+  if (!engine.start()) {
+    WARN("Skipping: the null PCM could not be started");
+    return;
+  }
+
+  CHECK_FALSE(device->stop());
+  CHECK_FALSE(device->start());
+  CHECK_FALSE(device->set_io_mode(audio_device_io_mode::output));
+  CHECK_FALSE(device->set_buffer_size_frames(device->get_buffer_size_frames()));
+  CHECK(device->is_running());
+  CHECK(engine.is_running());
+
+  engine.stop();
+  CHECK_FALSE(device->is_running());
+  CHECK(device->stop());
+}
+
+TEST_CASE("Rewind requests combine to the earliest position")
+{
+  __alsa_rewind_request request;
+  CHECK_FALSE(request.is_pending());
+  CHECK_FALSE(request.take());
+
+  request.request(4096);
+  request.request(1024);
+  request.request(2048);
+  CHECK(request.is_pending());
+  CHECK(request.take() == 1024u);
+
+  // taken requests are gone
+  CHECK_FALSE(request.is_pending());
+  CHECK_FALSE(request.take());
+
+  request.request(512);
+  request.clear();
+  CHECK_FALSE(request.take());
+}
+
+TEST_CASE("Concurrent rewind requests keep the earliest position")
+{
+  __alsa_rewind_request request;
+  std::vector<std::thread> threads;
+  for (uint64_t t = 0; t < 4; ++t) {
+    threads.emplace_back([&request, t] {
+      for (uint64_t position = 10'000; position > 100; --position)
+        request.request(position * 4 + t);
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  CHECK(request.take() == 101u * 4);
+}
+
+TEST_CASE("The output position can be followed from another thread")
+{
+  auto device = get_alsa_output_device("null");
+  if (!device) {
+    WARN("Skipping: the null PCM is not available");
+    return;
+  }
+
+  device->connect([](audio_device&, audio_device_io<float>&) noexcept {});
+  if (!device->start()) {
+    WARN("Skipping: the null PCM could not be started");
+    return;
+  }
+
+  // without rewinds the position only moves forward
+  uint64_t position = 0;
+  bool monotonic = true;
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+  while (position == 0 && std::chrono::steady_clock::now() < deadline) {
+    const uint64_t current = device->get_output_frame_position();
+    monotonic = monotonic && current >= position;
+    position = current;
+  }
+
+  CHECK(monotonic);
+  CHECK(position > 0);
+  CHECK(device->rewind_output(position / 2));
+  CHECK(device->stop());
+}
+
+TEST_CASE("Rewinds stay within what the hardware has not played")
+{
+  auto stream = make_stream(SND_PCM_STREAM_PLAYBACK);
+  stream.position = 10'000;
+
+  SECTION("all the way back to the requested position") {
+    CHECK(stream.rewind_frames(9'500, 768, 0, 0) == 500);
+  }
+
+  SECTION("no further than the rewindable frames less the margin") {
+    CHECK(stream.rewind_frames(9'000, 768, 0, 0) == 768);
+    CHECK(stream.rewind_frames(9'000, 768, 96, 0) == 672);
+    CHECK(stream.rewind_frames(9'000, 64, 96, 0) == 0);
+  }
+
+  SECTION("in whole blocks") {
+    CHECK(stream.rewind_frames(9'000, 768, 96, 256) == 512);
+    CHECK(stream.rewind_frames(9'900, 768, 0, 64) == 64);
+    CHECK(stream.rewind_frames(9'950, 768, 0, 64) == 0);
+  }
+
+  SECTION("not past the current position") {
+    CHECK(stream.rewind_frames(10'000, 768, 0, 0) == 0);
+    CHECK(stream.rewind_frames(12'000, 768, 0, 0) == 0);
+  }
+}
+
+#endif // __linux__
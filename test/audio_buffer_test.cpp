@@ -172,4 +172,34 @@ TEST_CASE("Deinterleaved pointer-to-pointer  buffer") {
     CHECK(left == std::array<float, 3>{6, 7, 8});
     CHECK(right == std::array<float, 3>{9, 10, 11});
   }
-}
\ No newline at end of file
+}
+
+TEST_CASE("Buffers hold 64 channels") {
+  constexpr size_t num_frames = 2;
+  constexpr size_t num_channels = 64;
+  std::array<float, num_frames * num_channels> data = {};
+  for (size_t i = 0; i < data.size(); ++i)
+    data[i] = float(i);
+
+  SECTION("Interleaved") {
+    auto buffer = audio_buffer(data.data(), num_frames, num_channels, contiguous_interleaved);
+    CHECK(buffer.size_channels() == num_channels);
+    CHECK(buffer(1, 63) == 127);
+  }
+
+  SECTION("Deinterleaved") {
+    auto buffer = audio_buffer(data.data(), num_frames, num_channels, contiguous_deinterleaved);
+    CHECK(buffer.size_channels() == num_channels);
+    CHECK(buffer(1, 63) == 127);
+  }
+
+  SECTION("Pointer-to-pointer") {
+    std::array<float*, num_channels> channels = {};
+    for (size_t channel = 0; channel < num_channels; ++channel)
+      channels[channel] = data.data() + channel * num_frames;
+
+    auto buffer = audio_buffer(channels.data(), num_frames, num_channels, ptr_to_ptr_deinterleaved);
+    CHECK(buffer.size_channels() == num_channels);
+    CHECK(buffer(1, 63) == 127);
+  }
+}
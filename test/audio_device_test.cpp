@@ -4,6 +4,11 @@
 // (See accompanying file LICENSE.md or copy at http://boost.org/LICENSE_1_0.txt)
 
 #include <audio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <set>
 #include <thread>
 #include "catch/catch.hpp"
@@ -162,12 +167,26 @@ TEST_CASE("All output devices have a positive sample rate")
 
 TEST_CASE("Setting a supported sample rate on input devices")
 {
-  // TODO: this needs to wait until we have an API to query supported settings
+  auto devices = get_audio_input_device_list();
+  for (auto& device : devices) {
+    for (auto sample_rate : device.get_supported_sample_rates()) {
+      CHECK(device.set_sample_rate(sample_rate));
+      CHECK(device.get_sample_rate() == sample_rate);
+    }
+    CHECK(!device.set_sample_rate(0));
+  }
 }
 
 TEST_CASE("Setting a supported sample rate on output devices")
 {
-  // TODO: this needs to wait until we have an API to query supported settings
+  auto devices = get_audio_output_device_list();
+  for (auto& device : devices) {
+    for (auto sample_rate : device.get_supported_sample_rates()) {
+      CHECK(device.set_sample_rate(sample_rate));
+      CHECK(device.get_sample_rate() == sample_rate);
+    }
+    CHECK(!device.set_sample_rate(0));
+  }
 }
 
 TEST_CASE("The buffer size type is integral")
@@ -396,6 +415,58 @@ TEST_CASE("Stopping an output device that is not running must succeed")
   }
 }
 
+namespace {
+  constexpr int num_start_stop_cycles = 1000;
+  constexpr auto max_start_duration = std::chrono::milliseconds(500);
+  constexpr auto max_stop_duration = std::chrono::milliseconds(100);
+
+  void check_start_stop_durations(audio_device& device)
+  {
+    using clock = std::chrono::steady_clock;
+
+    // A device that is busy or unplugged cannot be started at all; say so
+    // instead of passing silently. Once it has started, it must keep
+    // starting for the rest of the cycles.
+    if (!device.start()) {
+      WARN("Skipping " << device.name() << ": the device could not be started");
+      return;
+    }
+    device.stop();
+
+    for (int cycle = 0; cycle < num_start_stop_cycles; ++cycle) {
+      INFO("cycle " << cycle << " on " << device.name());
+
+      auto before_start = clock::now();
+      REQUIRE(device.start());
+
+      auto before_stop = clock::now();
+      device.stop();
+      auto after_stop = clock::now();
+
+      CHECK(before_stop - before_start < max_start_duration);
+      CHECK(after_stop - before_stop < max_stop_duration);
+    }
+  }
+}
+
+TEST_CASE("Starting and stopping an input device many times takes bounded time")
+{
+  auto devices = get_audio_input_device_list();
+  for (auto& device : devices) {
+    check_start_stop_durations(device);
+    CHECK_FALSE(device.is_running());
+  }
+}
+
+TEST_CASE("Starting and stopping an output device many times takes bounded time")
+{
+  auto devices = get_audio_output_device_list();
+  for (auto& device : devices) {
+    check_start_stop_durations(device);
+    CHECK_FALSE(device.is_running());
+  }
+}
+
 TEST_CASE("Register device list change callback")
 {
   auto cb = []{};
@@ -413,3 +484,42 @@ TEST_CASE("Register default output device change callback")
   auto cb = []{};
   set_audio_device_list_callback(audio_device_list_event::default_output_device_changed, cb);
 }
+
+#if defined(__linux__)
+TEST_CASE("Opening a PCM name ALSA does not know fails")
+{
+  CHECK(!get_alsa_output_device("libstdaudio_no_such_pcm").has_value());
+  CHECK(!get_alsa_input_device("libstdaudio_no_such_pcm").has_value());
+}
+
+TEST_CASE("Adding and removing a control device invokes the device list change callback")
+{
+  char directory[] = "/tmp/libstdaudio_test_XXXXXX";
+  REQUIRE(mkdtemp(directory) != nullptr);
+  const std::string control_device = std::string(directory) + "/controlC42";
+
+  std::atomic<int> num_changes = 0;
+  set_audio_device_list_directory(directory);
+  set_audio_device_list_callback(audio_device_list_event::device_list_changed, [&num_changes]{
+    ++num_changes;
+  });
+
+  auto wait_for_changes = [&num_changes](int expected) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (num_changes < expected && std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return num_changes >= expected;
+  };
+
+  std::fclose(std::fopen(control_device.c_str(), "w"));
+  CHECK(wait_for_changes(1));
+
+  const int num_changes_after_add = num_changes;
+  std::remove(control_device.c_str());
+  CHECK(wait_for_changes(num_changes_after_add + 1));
+
+  set_audio_device_list_callback(audio_device_list_event::device_list_changed, []{});
+  set_audio_device_list_directory("/dev/snd");
+  std::remove(directory);
+}
+#endif